@@ -23,6 +23,18 @@ const int NETWORK_PORT = 27016;
 
 // #define ENABLE_ACCELSTEPPER
 
+// Samples the digital ports into RAM at a high rate. Mostly useful on boards with lots of memory.
+// #define ENABLE_LOGIC_ANALYZER
+
+// Plays back timed sequences of digital port writes. Uses a hardware timer on the ESP32.
+// #define ENABLE_PATTERN_PLAYBACK
+
+// Non-blocking HC-SR04 ultrasonic distance sensors. The echo pins need interrupt support.
+// #define ENABLE_SONAR
+
+// Quadrature encoders. Uses PCNT units on the ESP32, pin change interrupts otherwise.
+// #define ENABLE_ENCODER
+
 // This is rarely used
 // #define ENABLE_BASIC_SCHEDULER
 #define ENABLE_SERIAL
@@ -116,6 +128,26 @@ AccelStepperFirmata accelStepper;
 Frequency frequency;
 #endif
 
+#ifdef ENABLE_LOGIC_ANALYZER
+#include <LogicAnalyzerFirmata.h>
+LogicAnalyzerFirmata logicAnalyzer;
+#endif
+
+#ifdef ENABLE_PATTERN_PLAYBACK
+#include <PatternPlaybackFirmata.h>
+PatternPlaybackFirmata patternPlayback;
+#endif
+
+#ifdef ENABLE_SONAR
+#include <SonarFirmata.h>
+SonarFirmata sonar;
+#endif
+
+#ifdef ENABLE_ENCODER
+#include <EncoderFirmata.h>
+EncoderFirmata encoder;
+#endif
+
 #ifdef ENABLE_BASIC_SCHEDULER
 // The scheduler allows to store scripts on the board, however this requires a kind of compiler on the client side.
 // When running dotnet/iot on the client side, prefer using the FirmataIlExecutor module instead
@@ -223,6 +255,22 @@ void initFirmata()
 	firmataExt.addFeature(sleeper);
 #endif
 
+#ifdef ENABLE_LOGIC_ANALYZER
+	firmataExt.addFeature(logicAnalyzer);
+#endif
+
+#ifdef ENABLE_PATTERN_PLAYBACK
+	firmataExt.addFeature(patternPlayback);
+#endif
+
+#ifdef ENABLE_SONAR
+	firmataExt.addFeature(sonar);
+#endif
+
+#ifdef ENABLE_ENCODER
+	firmataExt.addFeature(encoder);
+#endif
+
 	Firmata.attach(SYSTEM_RESET, systemResetCallback);
 }
 
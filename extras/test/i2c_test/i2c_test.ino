@@ -0,0 +1,229 @@
+/*
+ * Tests of the I2C job queue, using a fake bus instead of the Wire library.
+ * To run this test suite, you must first install the ArduinoUnit library
+ * to your Arduino/libraries/ directory.
+ * You can get ArduinoUnit here: https://github.com/mmurdoch/arduinounit
+ * Download version 2.0 or greater.
+ */
+
+#include <ArduinoUnit.h>
+#include <ConfigurableFirmata.h>
+#include <I2CFirmata.h>
+
+#define MAX_TRANSFERS 16
+
+struct transfer {
+  bool write;
+  byte address;
+  byte length;
+  byte firstByte; // of the data written
+};
+
+/*
+ * Records all transfers. Reads return the requested number of bytes.
+ */
+class FakeI2CBus: public I2CBus
+{
+  public:
+    transfer transfers[MAX_TRANSFERS];
+    byte count = 0;
+
+    void begin() override
+    {
+      count = 0;
+    }
+
+    bool write(byte address, const byte* data, byte length, bool stop) override
+    {
+      record(true, address, length, length > 0 ? data[0] : 0);
+      return true;
+    }
+
+    int read(byte address, byte* buffer, byte length) override
+    {
+      record(false, address, length, 0);
+      for (byte i = 0; i < length; i++) {
+        buffer[i] = i;
+      }
+      return length;
+    }
+
+  private:
+    void record(bool write, byte address, byte length, byte firstByte)
+    {
+      if (count < MAX_TRANSFERS) {
+        transfers[count].write = write;
+        transfers[count].address = address;
+        transfers[count].length = length;
+        transfers[count].firstByte = firstByte;
+        count++;
+      }
+    }
+};
+
+FakeStream stream;
+FakeI2CBus bus;
+
+void setup()
+{
+  Serial.begin(9600);
+}
+
+void loop()
+{
+  Test::run();
+}
+
+void enable(I2CFirmata& i2c)
+{
+  Firmata.begin(stream);
+  i2c.setBus(bus);
+  byte config[] = { 0, 0 };
+  i2c.handleSysex(I2C_CONFIG, 2, config);
+  bus.count = 0;
+}
+
+// Runs the queue until it is idle, including the settle time after writes
+void runJobs(I2CFirmata& i2c, bool elapsed)
+{
+  for (byte i = 0; i < 10; i++) {
+    i2c.report(elapsed && i == 0);
+    delayMicroseconds(I2C_WRITE_SETTLE_TIME + 10);
+  }
+}
+
+test(jobsAreExecutedInOrder)
+{
+  I2CFirmata i2c;
+  enable(i2c);
+
+  byte writeRequest[] = { 0x10, I2C_WRITE, 0x05, 0 };
+  i2c.handleSysex(I2C_REQUEST, 4, writeRequest);
+  byte readRequest[] = { 0x20, I2C_READ, 2, 0 };
+  i2c.handleSysex(I2C_REQUEST, 4, readRequest);
+  runJobs(i2c, false);
+
+  assertEqual(2, bus.count);
+  assertTrue(bus.transfers[0].write);
+  assertEqual(0x10, bus.transfers[0].address);
+  assertEqual(0x05, bus.transfers[0].firstByte);
+  assertFalse(bus.transfers[1].write);
+  assertEqual(0x20, bus.transfers[1].address);
+  assertEqual(2, bus.transfers[1].length);
+}
+
+test(queuedWriteKeepsItsData)
+{
+  I2CFirmata i2c;
+  enable(i2c);
+
+  // The read keeps the bus busy, so the write has to be queued
+  byte readRequest[] = { 0x20, I2C_READ, 2, 0 };
+  i2c.handleSysex(I2C_REQUEST, 4, readRequest);
+  byte writeRequest[] = { 0x10, I2C_WRITE, 0x05, 0, 0x06, 0 };
+  i2c.handleSysex(I2C_REQUEST, 6, writeRequest);
+  assertEqual(0, bus.count);
+  runJobs(i2c, false);
+
+  assertEqual(2, bus.count);
+  assertFalse(bus.transfers[0].write);
+  assertTrue(bus.transfers[1].write);
+  assertEqual(0x10, bus.transfers[1].address);
+  assertEqual(2, bus.transfers[1].length);
+  assertEqual(0x05, bus.transfers[1].firstByte);
+}
+
+test(registerReadIsSplitInTwoTransfers)
+{
+  I2CFirmata i2c;
+  enable(i2c);
+
+  byte readRequest[] = { 0x21, I2C_READ, 0x0A, 0, 3, 0 };
+  i2c.handleSysex(I2C_REQUEST, 6, readRequest);
+
+  i2c.report(false);
+  assertEqual(1, bus.count);
+  assertTrue(bus.transfers[0].write);
+  assertEqual(0x0A, bus.transfers[0].firstByte);
+
+  i2c.report(false);
+  assertEqual(2, bus.count);
+  assertFalse(bus.transfers[1].write);
+  assertEqual(0x21, bus.transfers[1].address);
+  assertEqual(3, bus.transfers[1].length);
+}
+
+test(allContinuousQueriesAreRead)
+{
+  I2CFirmata i2c;
+  enable(i2c);
+
+  // More queries than the job queue has slots
+  for (byte i = 0; i < I2C_MAX_QUERIES && i < MAX_TRANSFERS; i++) {
+    byte request[] = { (byte)(0x30 + i), I2C_READ_CONTINUOUSLY, 1, 0 };
+    i2c.handleSysex(I2C_REQUEST, 4, request);
+  }
+  for (byte i = 0; i < MAX_TRANSFERS; i++) {
+    i2c.report(i == 0);
+  }
+
+  byte expected = I2C_MAX_QUERIES < MAX_TRANSFERS ? I2C_MAX_QUERIES : MAX_TRANSFERS;
+  assertEqual(expected, bus.count);
+  for (byte i = 0; i < expected; i++) {
+    assertEqual(0x30 + i, bus.transfers[i].address);
+  }
+}
+
+test(stoppedQueryIsRemoved)
+{
+  I2CFirmata i2c;
+  enable(i2c);
+
+  byte first[] = { 0x30, I2C_READ_CONTINUOUSLY, 1, 0 };
+  i2c.handleSysex(I2C_REQUEST, 4, first);
+  byte second[] = { 0x31, I2C_READ_CONTINUOUSLY, 1, 0 };
+  i2c.handleSysex(I2C_REQUEST, 4, second);
+  byte stop[] = { 0x30, I2C_STOP_READING };
+  i2c.handleSysex(I2C_REQUEST, 2, stop);
+  runJobs(i2c, true);
+
+  assertEqual(1, bus.count);
+  assertEqual(0x31, bus.transfers[0].address);
+}
+
+test(stoppingUnknownDeviceKeepsQueries)
+{
+  I2CFirmata i2c;
+  enable(i2c);
+
+  byte first[] = { 0x30, I2C_READ_CONTINUOUSLY, 1, 0 };
+  i2c.handleSysex(I2C_REQUEST, 4, first);
+  byte stop[] = { 0x40, I2C_STOP_READING };
+  i2c.handleSysex(I2C_REQUEST, 2, stop);
+  runJobs(i2c, true);
+
+  assertEqual(1, bus.count);
+  assertEqual(0x30, bus.transfers[0].address);
+}
+
+test(removingQueryOfTemplateInvalidatesIt)
+{
+  I2CFirmata i2c;
+  enable(i2c);
+
+  byte first[] = { 0x30, I2C_READ_CONTINUOUSLY, 1, 0 };
+  i2c.handleSysex(I2C_REQUEST, 4, first);
+  byte second[] = { 0x31, I2C_READ_CONTINUOUSLY, 1, 0 };
+  i2c.handleSysex(I2C_REQUEST, 4, second);
+  int32_t value;
+  assertTrue(i2c.readReportSource(REPORT_SOURCE_I2C_QUERY, 1, &value));
+
+  // The second query moves to index 0, so the template would read the wrong device
+  byte stop[] = { 0x30, I2C_STOP_READING };
+  i2c.handleSysex(I2C_REQUEST, 2, stop);
+  assertFalse(i2c.readReportSource(REPORT_SOURCE_I2C_QUERY, 0, &value));
+
+  // Until the template is set again
+  i2c.reportTemplateChanged();
+  assertTrue(i2c.readReportSource(REPORT_SOURCE_I2C_QUERY, 0, &value));
+}
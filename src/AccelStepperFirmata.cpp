@@ -47,6 +47,7 @@ void AccelStepperFirmata::reportPosition(byte deviceNum, bool complete)
     long position = stepper[deviceNum]->currentPosition();
     encode32BitSignedInteger(position, data);
 
+    Firmata.sendTimestamp();
     Firmata.write(START_SYSEX);
     Firmata.write(ACCELSTEPPER_DATA);
     if (complete) {
@@ -64,6 +65,15 @@ void AccelStepperFirmata::reportPosition(byte deviceNum, bool complete)
   }
 }
 
+bool AccelStepperFirmata::readReportSource(byte sourceType, byte index, int32_t* value)
+{
+  if (sourceType != REPORT_SOURCE_STEPPER || index >= MAX_ACCELSTEPPERS || !stepper[index]) {
+    return false;
+  }
+  *value = stepper[index]->currentPosition();
+  return true;
+}
+
 void AccelStepperFirmata::reportGroupComplete(byte deviceNum)
 {
   if (group[deviceNum]) {
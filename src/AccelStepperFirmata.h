@@ -55,6 +55,7 @@ class AccelStepperFirmata: public FirmataFeature
     long decode32BitSignedInteger(byte arg1, byte arg2, byte arg3, byte arg4, byte arg5);
     void encode32BitSignedInteger(long value, byte pdata[]);
     void report(bool elapsed) override;
+    bool readReportSource(byte sourceType, byte index, int32_t* value) override;
     void reset();
   private:
     AccelStepper *stepper[MAX_ACCELSTEPPERS];
@@ -21,69 +21,143 @@
 
 AnalogInputFirmata *AnalogInputFirmataInstance;
 
-static int AnalogToPin(int analogChannel)
+void reportAnalogInputCallback(byte analogPin, int value)
 {
-    for (byte pin = 0; pin < TOTAL_PINS; pin++)
-    {
-        if (analogChannel == PIN_TO_ANALOG(pin))
-        {
-            return pin;
-        }
+  AnalogInputFirmataInstance->reportAnalog(analogPin, value == 1, AnalogInputFirmataInstance->channelToPin(analogPin));
+}
+
+AnalogInputFirmata::AnalogInputFirmata()
+{
+  AnalogInputFirmataInstance = this;
+  memset(analogInputsToReport, 0, sizeof(analogInputsToReport));
+  // Build the channel <-> pin lookup tables once, the PIN_TO_ANALOG macro is a function call on some boards
+  memset(analogChannelToPin, 0, sizeof(analogChannelToPin));
+  for (byte pin = 0; pin < TOTAL_PINS; pin++) {
+    pinToAnalogChannel[pin] = ANALOG_NOT_AN_ANALOG_PIN;
+    if (FIRMATA_IS_PIN_ANALOG(pin)) {
+      byte analogChannel = PIN_TO_ANALOG(pin);
+      if (analogChannel < TOTAL_ANALOG_PINS) {
+        pinToAnalogChannel[pin] = analogChannel;
+        analogChannelToPin[analogChannel] = pin;
+      }
     }
+  }
+#ifdef ESP32
+  continuousSampleRate = 0;
+  continuousAveraging = ANALOG_CONTINUOUS_DEFAULT_AVERAGING;
+  continuousActive = false;
+  continuousPinCount = 0;
+#endif
+  for (byte i = 0; i < TOTAL_ANALOG_PINS; i++) {
+    resetChannelConfig(i);
+  }
+  Firmata.attach(REPORT_ANALOG, reportAnalogInputCallback);
+}
 
-    return 0;
+void AnalogInputFirmata::resetChannelConfig(byte analogPin)
+{
+  channels[analogPin].lastValue = 0;
+  channels[analogPin].absoluteDeadband = 0;
+  channels[analogPin].relativeDeadband = 0;
+  channels[analogPin].maxSilence = 0;
+  channels[analogPin].lastReportTime = 0;
+  channels[analogPin].filterMode = ANALOG_FILTER_NONE;
+  channels[analogPin].filterParameter = 0;
+  channels[analogPin].averageSlot = ANALOG_NO_AVERAGE_SLOT;
+  restartFilter(analogPin);
 }
 
-void reportAnalogInputCallback(byte analogPin, int value)
+void AnalogInputFirmata::restartFilter(byte analogPin)
 {
-  AnalogInputFirmataInstance->reportAnalog(analogPin, value == 1, (byte)AnalogToPin(analogPin));
+  channels[analogPin].sampleCount = 0;
+  channels[analogPin].filterState = 0;
+  channels[analogPin].outputReady = false;
+  channels[analogPin].windowPos = 0;
 }
 
-AnalogInputFirmata::AnalogInputFirmata()
+/*
+ * Sets the filter of a channel. A moving average needs one of the shared windows, returns false if none is free.
+ */
+bool AnalogInputFirmata::setFilter(byte analogPin, byte filterMode, byte filterParameter)
 {
-  AnalogInputFirmataInstance = this;
-  analogInputsToReport = 0;
-  Firmata.attach(REPORT_ANALOG, reportAnalogInputCallback);
+  analog_channel_info& info = channels[analogPin];
+  if (filterMode != ANALOG_FILTER_AVERAGE) {
+    info.averageSlot = ANALOG_NO_AVERAGE_SLOT;
+  } else if (info.averageSlot == ANALOG_NO_AVERAGE_SLOT) {
+    for (byte slot = 0; slot < ANALOG_AVERAGE_SLOTS && info.averageSlot == ANALOG_NO_AVERAGE_SLOT; slot++) {
+      bool used = false;
+      for (byte i = 0; i < TOTAL_ANALOG_PINS; i++) {
+        used = used || channels[i].averageSlot == slot;
+      }
+      if (!used) {
+        info.averageSlot = slot;
+      }
+    }
+    if (info.averageSlot == ANALOG_NO_AVERAGE_SLOT) {
+      return false;
+    }
+  }
+  info.filterMode = filterMode;
+  info.filterParameter = filterParameter;
+  restartFilter(analogPin);
+  return true;
+}
+
+byte AnalogInputFirmata::channelToPin(byte analogChannel)
+{
+  return analogChannel < TOTAL_ANALOG_PINS ? analogChannelToPin[analogChannel] : 0;
 }
 
 // -----------------------------------------------------------------------------
-/* sets bits in a bit array (int) to toggle the reporting of the analogIns
+/* sets bits in a bit array to toggle the reporting of the analogIns
  */
 void AnalogInputFirmata::reportAnalog(byte analogPin, bool enable, byte physicalPin)
 {
   if (analogPin < TOTAL_ANALOG_PINS) {
+#ifdef ESP32
+    // The set of sampled pins changes, and one-shot conversions are not possible while the DMA runs
+    stopContinuousSampling();
+#endif
     if (enable == false)
 	{
-        analogInputsToReport = analogInputsToReport & ~ (1 << analogPin);
+        analogInputsToReport[analogPin >> 3] &= ~(1 << (analogPin & 7));
     } 
 	else 
 	{
-        analogInputsToReport = analogInputsToReport | (1 << analogPin);
+        analogInputsToReport[analogPin >> 3] |= 1 << (analogPin & 7);
+        restartFilter(analogPin);
 		// prevent during system reset or all analog pin values will be reported
         // which may report noise for unconnected analog pins
         if (!Firmata.isResetting()) 
 		{
             // Send pin value immediately. This is helpful when connected via
             // ethernet, wi-fi or bluetooth so pin states can be known upon
-            // reconnecting.
-		    Firmata.sendAnalog(analogPin, analogRead(physicalPin));
+            // reconnecting. It goes through the filter, so it has the same scale as the following values.
+            int value;
+            if (sampleChannel(analogPin, physicalPin, &value))
+            {
+                sendAnalogValue(analogPin, value);
+            }
         }
     }
+#ifdef ESP32
+    startContinuousSampling();
+#endif
   }
   // TODO: save status to EEPROM here, if changed
 }
 
 boolean AnalogInputFirmata::handlePinMode(byte pin, int mode)
 {
-  if (FIRMATA_IS_PIN_ANALOG(pin)) {
+  if (pin < TOTAL_PINS && pinToAnalogChannel[pin] != ANALOG_NOT_AN_ANALOG_PIN) {
     if (mode == PIN_MODE_ANALOG) {
-      reportAnalog(PIN_TO_ANALOG(pin), true, pin); // turn on reporting
+      reportAnalog(pinToAnalogChannel[pin], true, pin); // turn on reporting
       if (IS_PIN_DIGITAL(pin)) {
         pinMode(PIN_TO_DIGITAL(pin), INPUT); // disable output driver
       }
       return true;
     } else {
-      reportAnalog(PIN_TO_ANALOG(pin), false, pin); // turn off reporting
+      reportAnalog(pinToAnalogChannel[pin], false, pin); // turn off reporting
     }
   }
   return false;
@@ -103,7 +177,7 @@ boolean AnalogInputFirmata::handleSysex(byte command, byte argc, byte* argv)
     Firmata.write(START_SYSEX);
     Firmata.write(ANALOG_MAPPING_RESPONSE);
     for (byte pin = 0; pin < TOTAL_PINS; pin++) {
-      Firmata.write(FIRMATA_IS_PIN_ANALOG(pin) ? PIN_TO_ANALOG(pin) : 127);
+      Firmata.write(pinToAnalogChannel[pin]);
     }
     Firmata.write(END_SYSEX);
     return true;
@@ -111,32 +185,286 @@ boolean AnalogInputFirmata::handleSysex(byte command, byte argc, byte* argv)
   if (command == EXTENDED_REPORT_ANALOG && argc >= 2)
   {
   	byte analogChannel = argv[0];
-  	reportAnalog(analogChannel, argv[1] == 1, (byte)AnalogToPin(analogChannel));
+  	reportAnalog(analogChannel, argv[1] == 1, channelToPin(analogChannel));
 	return true;
   }
+  if (command == ANALOG_CONFIG)
+  {
+    return handleAnalogConfig(argc, argv);
+  }
+  return false;
+}
+
+/*
+ * ANALOG_CONFIG, subcommand ANALOG_CONFIG_DEADBAND:
+ * argv[0]: ANALOG_CONFIG_DEADBAND
+ * argv[1]: analog channel, or ANALOG_CONFIG_ALL_CHANNELS
+ * argv[2,3]: absolute deadband in ADC counts (14 bit)
+ * argv[4,5]: relative deadband in 1/1024 of the last reported value (14 bit)
+ * argv[6..8]: max silence time in ms (21 bit, clamped to 65535). 0 disables the heartbeat.
+ * A channel is reported when its value differs from the last reported value by at least
+ * the larger of the two deadbands, or when it has been silent for max silence time.
+ * With both deadbands 0 (the default), every sample is reported.
+ */
+boolean AnalogInputFirmata::handleAnalogConfig(byte argc, byte* argv)
+{
+  if (argc < 1)
+  {
+    return false;
+  }
+  if (argv[0] == ANALOG_CONFIG_DEADBAND)
+  {
+    if (argc < 9)
+    {
+      Firmata.sendString(F("Not enough bytes in ANALOG_CONFIG message"));
+      return true;
+    }
+    byte analogChannel = argv[1];
+    unsigned int absoluteDeadband = Firmata.decodePackedUInt14(argv + 2);
+    unsigned int relativeDeadband = Firmata.decodePackedUInt14(argv + 4);
+    uint32_t maxSilence = (uint32_t)argv[6] | ((uint32_t)argv[7] << 7) | ((uint32_t)argv[8] << 14);
+    if (maxSilence > 0xFFFF)
+    {
+      maxSilence = 0xFFFF;
+    }
+    for (byte i = 0; i < TOTAL_ANALOG_PINS; i++)
+    {
+      if (i == analogChannel || analogChannel == ANALOG_CONFIG_ALL_CHANNELS)
+      {
+        channels[i].absoluteDeadband = absoluteDeadband;
+        channels[i].relativeDeadband = relativeDeadband;
+        channels[i].maxSilence = (uint16_t)maxSilence;
+      }
+    }
+    return true;
+  }
+  if (argv[0] == ANALOG_CONFIG_FILTER)
+  {
+    // argv[1]: analog channel, or ANALOG_CONFIG_ALL_CHANNELS
+    // argv[2]: filter mode (ANALOG_FILTER_*)
+    // argv[3]: filter parameter: extra bits (oversample), number of samples (average) or coefficient in 1/128 (IIR)
+    if (argc < 4)
+    {
+      Firmata.sendString(F("Not enough bytes in ANALOG_CONFIG message"));
+      return true;
+    }
+    byte analogChannel = argv[1];
+    byte filterMode = argv[2];
+    byte filterParameter = argv[3];
+    if (filterMode == ANALOG_FILTER_OVERSAMPLE)
+    {
+      // The result must still fit into the 14 bits of an analog message
+      if (filterParameter > ANALOG_MAX_OVERSAMPLING_BITS) filterParameter = ANALOG_MAX_OVERSAMPLING_BITS;
+      if (filterParameter > 14 - DEFAULT_ADC_RESOLUTION) filterParameter = 14 - DEFAULT_ADC_RESOLUTION;
+    }
+    else if ((filterMode == ANALOG_FILTER_AVERAGE || filterMode == ANALOG_FILTER_IIR) && filterParameter == 0)
+    {
+      filterMode = ANALOG_FILTER_NONE;
+    }
+    else if (filterMode == ANALOG_FILTER_AVERAGE && filterParameter > ANALOG_AVERAGE_MAX_SAMPLES)
+    {
+      filterParameter = ANALOG_AVERAGE_MAX_SAMPLES;
+    }
+    else if (filterMode > ANALOG_FILTER_IIR)
+    {
+      Firmata.sendString(F("Unknown analog filter mode"));
+      return true;
+    }
+    for (byte i = 0; i < TOTAL_ANALOG_PINS; i++)
+    {
+      if ((i == analogChannel || analogChannel == ANALOG_CONFIG_ALL_CHANNELS) && !setFilter(i, filterMode, filterParameter))
+      {
+        Firmata.sendString(F("No free moving average window for analog channel"), i);
+      }
+    }
+    return true;
+  }
   return false;
 }
 
 void AnalogInputFirmata::reset()
 {
   // by default, do not report any analog inputs
-  analogInputsToReport = 0;
+  memset(analogInputsToReport, 0, sizeof(analogInputsToReport));
+#ifdef ESP32
+  stopContinuousSampling();
+#endif
+  for (byte i = 0; i < TOTAL_ANALOG_PINS; i++) {
+    resetChannelConfig(i);
+  }
+}
+
+int AnalogInputFirmata::readChannel(byte analogPin, byte physicalPin)
+{
+#ifdef ESP32
+  if (continuousActive) {
+    return continuousValues[analogPin];
+  }
+#endif
+  return analogRead(physicalPin);
+}
+
+/*
+ * Adds one conversion to the oversampling sum. The conversions are spread over the loop passes, so that
+ * oversampling doesn't block the loop. The first conversion is scaled up, so that there is a result right away.
+ */
+void AnalogInputFirmata::accumulateOversample(byte analogPin, byte physicalPin)
+{
+  analog_channel_info& info = channels[analogPin];
+  int sample = readChannel(analogPin, physicalPin);
+  if (!info.outputReady) {
+    info.filterOutput = sample << info.filterParameter;
+    info.outputReady = true;
+  }
+  // Summing 4^n samples and dividing by 2^n adds n bits of resolution
+  info.filterState += sample;
+  if (++info.sampleCount >= (1 << (2 * info.filterParameter))) {
+    info.filterOutput = (int)(info.filterState >> info.filterParameter);
+    info.filterState = 0;
+    info.sampleCount = 0;
+  }
+}
+
+/*
+ * Reads the channel and runs the configured filter. All filters use integer arithmetic only.
+ * Returns false if the filter has no output value yet.
+ */
+bool AnalogInputFirmata::sampleChannel(byte analogPin, byte physicalPin, int* value)
+{
+  analog_channel_info& info = channels[analogPin];
+  switch (info.filterMode)
+  {
+    case ANALOG_FILTER_OVERSAMPLE:
+      // The conversions are taken in report(), only start if there wasn't one yet
+      if (!info.outputReady) {
+        accumulateOversample(analogPin, physicalPin);
+      }
+      *value = info.filterOutput;
+      return true;
+    case ANALOG_FILTER_AVERAGE:
+    {
+      uint16_t* window = averageWindows[info.averageSlot];
+      uint16_t sample = (uint16_t)readChannel(analogPin, physicalPin);
+      if (info.sampleCount < info.filterParameter) {
+        info.sampleCount++;
+      } else {
+        info.filterState -= window[info.windowPos];
+      }
+      window[info.windowPos] = sample;
+      info.filterState += sample;
+      info.windowPos = info.windowPos + 1 < info.filterParameter ? info.windowPos + 1 : 0;
+      *value = (int)(info.filterState / info.sampleCount);
+      break;
+    }
+    case ANALOG_FILTER_IIR:
+    {
+      int32_t sample = (int32_t)readChannel(analogPin, physicalPin) << 8;
+      if (info.sampleCount == 0) {
+        // Start at the first sample instead of slowly rising from 0
+        info.filterState = sample;
+        info.sampleCount = 1;
+      } else {
+        info.filterState += ((sample - info.filterState) * info.filterParameter) >> 7;
+      }
+      *value = (int)((info.filterState + 0x80) >> 8);
+      break;
+    }
+    default:
+      *value = readChannel(analogPin, physicalPin);
+      break;
+  }
+  info.filterOutput = *value;
+  info.outputReady = true;
+  return true;
+}
+
+bool AnalogInputFirmata::isReportDue(byte analogPin, int value)
+{
+  analog_channel_info& info = channels[analogPin];
+  unsigned int threshold = (unsigned int)(((uint32_t)info.lastValue * info.relativeDeadband) >> 10);
+  if (threshold < info.absoluteDeadband) {
+    threshold = info.absoluteDeadband;
+  }
+  // A relative deadband on a small value would round down to 0 and report every sample
+  if (threshold == 0 && (info.absoluteDeadband > 0 || info.relativeDeadband > 0)) {
+    threshold = 1;
+  }
+  unsigned int difference = value > info.lastValue ? value - info.lastValue : info.lastValue - value;
+  if (difference >= threshold) {
+    return true;
+  }
+  // 16-bit wrap-around arithmetic is fine here, since maxSilence is at most 0xFFFF
+  return info.maxSilence > 0 && (uint16_t)((uint16_t)millis() - info.lastReportTime) >= info.maxSilence;
+}
+
+void AnalogInputFirmata::sendAnalogValue(byte analogPin, int value)
+{
+  channels[analogPin].lastValue = value;
+  channels[analogPin].lastReportTime = (uint16_t)millis();
+  Firmata.sendAnalog(analogPin, value);
+}
+
+/*
+ * Report templates get the last filtered value, the same as the analog messages. Only if the channel wasn't
+ * sampled yet, the first value is taken here. Channels whose pin is not in analog mode read as 0.
+ */
+bool AnalogInputFirmata::readReportSource(byte sourceType, byte index, int32_t* value)
+{
+  if (sourceType != REPORT_SOURCE_ANALOG || index >= TOTAL_ANALOG_PINS) {
+    return false;
+  }
+  byte pin = analogChannelToPin[index];
+  if (Firmata.getPinMode(pin) != PIN_MODE_ANALOG) {
+    *value = 0;
+    return true;
+  }
+  int filtered = channels[index].filterOutput;
+  if (!channels[index].outputReady) {
+    sampleChannel(index, pin, &filtered);
+  }
+  *value = filtered;
+  return true;
 }
 
 void AnalogInputFirmata::report(bool elapsed)
 {
+#ifdef ESP32
+  pollContinuousSampling();
+#endif
+  // Oversampling channels take one conversion per loop pass. Only the enabled channels are walked, skipping
+  // 8 disabled channels at once
+  for (byte i = 0; i < sizeof(analogInputsToReport); i++) {
+    byte analogPin = i << 3;
+    for (byte bits = analogInputsToReport[i]; bits != 0; bits >>= 1, analogPin++) {
+      if ((bits & 1) == 0 || channels[analogPin].filterMode != ANALOG_FILTER_OVERSAMPLE) {
+        continue;
+      }
+      byte pin = analogChannelToPin[analogPin];
+      if (Firmata.getPinMode(pin) == PIN_MODE_ANALOG) {
+        accumulateOversample(analogPin, pin);
+      }
+    }
+  }
   if (!elapsed)
   {
     return;
   }
 
-  byte pin, analogPin;
   /* ANALOGREAD - do all analogReads() at the configured sampling interval */
-  for (pin = 0; pin < TOTAL_PINS; pin++) {
-    if (FIRMATA_IS_PIN_ANALOG(pin) && Firmata.getPinMode(pin) == PIN_MODE_ANALOG) {
-      analogPin = PIN_TO_ANALOG(pin);
-      if (analogInputsToReport & (1 << analogPin)) {
-        Firmata.sendAnalog(analogPin, analogRead(pin));
+  // Only walk the enabled channels, skipping 8 disabled channels at once
+  for (byte i = 0; i < sizeof(analogInputsToReport); i++) {
+    byte analogPin = i << 3;
+    for (byte bits = analogInputsToReport[i]; bits != 0; bits >>= 1, analogPin++) {
+      if ((bits & 1) == 0) {
+        continue;
+      }
+      byte pin = analogChannelToPin[analogPin];
+      if (Firmata.getPinMode(pin) != PIN_MODE_ANALOG) {
+        continue;
+      }
+      int value;
+      if (sampleChannel(analogPin, pin, &value) && isReportDue(analogPin, value)) {
+        sendAnalogValue(analogPin, value);
       }
     }
   }
@@ -21,6 +21,49 @@
 #include "FirmataFeature.h"
 #include "FirmataReporting.h"
 
+#define ANALOG_CONFIG_DEADBAND      0x00
+#define ANALOG_CONFIG_FILTER        0x01
+#define ANALOG_CONFIG_ALL_CHANNELS  0x7F
+#define ANALOG_NOT_AN_ANALOG_PIN    127 // value of the pin to channel map for pins without ADC
+
+#define ANALOG_FILTER_NONE          0x00 // report the raw value (default)
+#define ANALOG_FILTER_OVERSAMPLE    0x01 // 4^n samples, decimated to n additional bits. One conversion per loop pass.
+#define ANALOG_FILTER_AVERAGE       0x02 // moving average of the last n samples
+#define ANALOG_FILTER_IIR           0x03 // first order low pass, y += (x - y) * n / 128
+
+#define ANALOG_MAX_OVERSAMPLING_BITS 3 // 64 conversions per result
+
+#ifdef LARGE_MEM_DEVICE
+#define ANALOG_AVERAGE_MAX_SAMPLES  16 // window size of the moving average
+#define ANALOG_AVERAGE_SLOTS        4  // channels that can use the moving average at the same time
+#else
+#define ANALOG_AVERAGE_MAX_SAMPLES  8
+#define ANALOG_AVERAGE_SLOTS        2
+#endif
+#define ANALOG_NO_AVERAGE_SLOT      0xFF
+
+// System variables for the continuous (DMA) sampling mode of the ESP32
+#define ANALOG_VARIABLE_CONTINUOUS_RATE      104 // conversions per second, 0 = one-shot conversions (default)
+#define ANALOG_VARIABLE_CONTINUOUS_AVERAGING 105 // conversions averaged per pin and result
+#define ANALOG_CONTINUOUS_DEFAULT_AVERAGING  8
+
+/* per-channel report filtering */
+struct analog_channel_info {
+  int lastValue;                // last value sent to the host
+  unsigned int absoluteDeadband; // minimum change (in ADC counts) that triggers a report
+  unsigned int relativeDeadband; // minimum change in 1/1024 of the last value that triggers a report
+  uint16_t maxSilence;          // report at least every maxSilence ms, even without change (0 = never)
+  uint16_t lastReportTime;      // lower 16 bits of millis() at the last report
+  byte filterMode;              // one of the ANALOG_FILTER_* constants
+  byte filterParameter;         // meaning depends on filterMode
+  byte sampleCount;             // number of samples accumulated in filterState
+  int32_t filterState;          // sum of samples (oversample, average) or filter output in 24.8 fixed point (IIR)
+  int filterOutput;             // last filter result, also used by report templates
+  bool outputReady;             // filterOutput is set
+  byte averageSlot;             // window in averageWindows holding the samples summed up in filterState (average)
+  byte windowPos;               // next entry of the window to replace (average)
+};
+
 void reportAnalogInputCallback(byte analogPin, int value);
 
 class AnalogInputFirmata: public FirmataFeature
@@ -28,14 +71,46 @@ class AnalogInputFirmata: public FirmataFeature
   public:
     AnalogInputFirmata();
     void reportAnalog(byte analogPin, bool enable, byte physicalPin);
+    byte channelToPin(byte analogChannel);
     void handleCapability(byte pin);
     boolean handlePinMode(byte pin, int mode);
     boolean handleSysex(byte command, byte argc, byte* argv);
     void reset();
     void report(bool elapsed) override;
+    bool readReportSource(byte sourceType, byte index, int32_t* value) override;
+#ifdef ESP32
+    bool handleSystemVariableQuery(bool write, SystemVariableDataType* data_type, int variable_id, byte pin, SystemVariableError* status, int* value) override;
+#endif
   private:
     /* analog inputs */
-    int analogInputsToReport; // bitwise array to store pin reporting (bit0 = A0, bit1 = A1, etc.)
+    byte analogInputsToReport[(TOTAL_ANALOG_PINS + 7) / 8]; // bitwise array to store pin reporting (bit0 = A0, bit1 = A1, etc.)
+    byte analogChannelToPin[TOTAL_ANALOG_PINS];
+    byte pinToAnalogChannel[TOTAL_PINS]; // ANALOG_NOT_AN_ANALOG_PIN for pins without ADC
+    analog_channel_info channels[TOTAL_ANALOG_PINS];
+    // The windows of the moving average are shared, so that channels without it don't need the memory
+    uint16_t averageWindows[ANALOG_AVERAGE_SLOTS][ANALOG_AVERAGE_MAX_SAMPLES];
+
+    void resetChannelConfig(byte analogPin);
+    boolean handleAnalogConfig(byte argc, byte* argv);
+    int readChannel(byte analogPin, byte physicalPin);
+    bool sampleChannel(byte analogPin, byte physicalPin, int* value);
+    void accumulateOversample(byte analogPin, byte physicalPin);
+    void restartFilter(byte analogPin);
+    bool setFilter(byte analogPin, byte filterMode, byte filterParameter);
+    bool isReportDue(byte analogPin, int value);
+    void sendAnalogValue(byte analogPin, int value);
+
+#ifdef ESP32
+    /* continuous (DMA) sampling, see AnalogInputFirmataEsp32.cpp */
+    uint32_t continuousSampleRate; // conversions per second, 0 to use analogRead() instead
+    uint32_t continuousAveraging;  // number of conversions averaged per pin and result
+    bool continuousActive;
+    byte continuousPinCount;
+    int continuousValues[TOTAL_ANALOG_PINS];
+    void startContinuousSampling();
+    void stopContinuousSampling();
+    void pollContinuousSampling();
+#endif
 };
 
 #endif
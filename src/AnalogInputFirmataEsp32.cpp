@@ -0,0 +1,118 @@
+/*
+  AnalogInputFirmataEsp32.cpp - Firmata library
+  Continuous (DMA based) sampling backend of AnalogInputFirmata for the ESP32.
+  Copyright (C) 2006-2008 Hans-Christoph Steiner.  All rights reserved.
+  Copyright (C) 2010-2011 Paul Stoffregen.  All rights reserved.
+  Copyright (C) 2009 Shigeru Kobayashi.  All rights reserved.
+  Copyright (C) 2013 Norbert Truchsess. All rights reserved.
+  Copyright (C) 2009-2015 Jeff Hoefs.  All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <ConfigurableFirmata.h>
+#include "AnalogInputFirmata.h"
+#ifdef ESP32
+
+// Set from the ADC driver interrupt when a new set of averaged results is available
+static volatile bool continuousDataReady = false;
+
+static void ARDUINO_ISR_ATTR continuousConversionDone()
+{
+  continuousDataReady = true;
+}
+
+/*
+ * (Re)starts the continuous sampling for all channels that are currently reported.
+ * If the driver rejects the configuration (e.g. because a pin is on ADC2, which can't
+ * be used with DMA), the feature falls back to one-shot conversions.
+ */
+void AnalogInputFirmata::startContinuousSampling()
+{
+  stopContinuousSampling();
+  if (continuousSampleRate == 0) {
+    return;
+  }
+
+  uint8_t pins[TOTAL_ANALOG_PINS];
+  size_t pinCount = 0;
+  for (byte analogPin = 0; analogPin < TOTAL_ANALOG_PINS; analogPin++) {
+    if (analogInputsToReport[analogPin >> 3] & (1 << (analogPin & 7))) {
+      pins[pinCount++] = analogChannelToPin[analogPin];
+    }
+  }
+  if (pinCount == 0) {
+    return;
+  }
+
+  for (size_t i = 0; i < pinCount; i++) {
+    // Start with a one-shot value, so that nothing bogus is reported before the first DMA frame completes
+    continuousValues[pinToAnalogChannel[pins[i]]] = analogRead(pins[i]);
+  }
+
+  continuousDataReady = false;
+  if (!analogContinuous(pins, pinCount, continuousAveraging, continuousSampleRate, continuousConversionDone) || !analogContinuousStart()) {
+    analogContinuousDeinit();
+    Firmata.sendString(F("Continuous ADC sampling not possible with these pins, using one-shot conversions"));
+    return;
+  }
+  continuousPinCount = (byte)pinCount;
+  continuousActive = true;
+}
+
+void AnalogInputFirmata::stopContinuousSampling()
+{
+  if (!continuousActive) {
+    return;
+  }
+  analogContinuousStop();
+  analogContinuousDeinit();
+  continuousActive = false;
+}
+
+/*
+ * Copies the latest averaged results out of the driver. This is cheap, so it is done on every loop.
+ */
+void AnalogInputFirmata::pollContinuousSampling()
+{
+  if (!continuousActive || !continuousDataReady) {
+    return;
+  }
+  continuousDataReady = false;
+  adc_continuous_data_t* results = nullptr;
+  if (!analogContinuousRead(&results, 0) || results == nullptr) {
+    return;
+  }
+  // There's one entry per pin passed to analogContinuous()
+  for (byte i = 0; i < continuousPinCount; i++) {
+    continuousValues[pinToAnalogChannel[results[i].pin]] = results[i].avg_read_raw;
+  }
+}
+
+bool AnalogInputFirmata::handleSystemVariableQuery(bool write, SystemVariableDataType* data_type, int variable_id, byte pin, SystemVariableError* status, int* value)
+{
+  if (variable_id != ANALOG_VARIABLE_CONTINUOUS_RATE && variable_id != ANALOG_VARIABLE_CONTINUOUS_AVERAGING) {
+    return false;
+  }
+
+  *data_type = SystemVariableDataType::Int;
+  uint32_t& variable = variable_id == ANALOG_VARIABLE_CONTINUOUS_RATE ? continuousSampleRate : continuousAveraging;
+  if (write) {
+    if (*value < 0 || (variable_id == ANALOG_VARIABLE_CONTINUOUS_AVERAGING && *value == 0)) {
+      *status = SystemVariableError::Error;
+      return true;
+    }
+    variable = (uint32_t)*value;
+    startContinuousSampling();
+  }
+  *value = (int)variable;
+  *status = SystemVariableError::NoError;
+  return true;
+}
+
+#endif
@@ -34,8 +34,8 @@ extern "C" {
  */
 void FirmataClass::sendValueAsTwo7bitBytes(int value)
 {
-  FirmataStream->write(value & 0B01111111); // LSB
-  FirmataStream->write(value >> 7 & 0B01111111); // MSB
+  write(value & 0B01111111); // LSB
+  write(value >> 7 & 0B01111111); // MSB
 }
 
 /**
@@ -43,7 +43,119 @@ void FirmataClass::sendValueAsTwo7bitBytes(int value)
  */
 void FirmataClass::startSysex(void)
 {
-  FirmataStream->write(START_SYSEX);
+  write(START_SYSEX);
+}
+
+/**
+ * Pushes out any buffered output data, to minimize the latency of time-critical messages.
+ */
+void FirmataClass::flush(void)
+{
+  FirmataStream->flush();
+}
+
+/**
+ * Returns the number of writes the stream rejected (e.g. because a non-blocking
+ * socket was full) and clears the counter.
+ */
+uint16_t FirmataClass::takeSendFailures(void)
+{
+  uint16_t failures = sendFailures;
+  sendFailures = 0;
+  return failures;
+}
+
+/**
+ * Enables measuring the time spent writing to the stream. This costs two calls to micros() per write,
+ * so it's off by default.
+ */
+void FirmataClass::measureSendTime(boolean enable)
+{
+  sendTimeMeasured = enable;
+  sendTime = 0;
+}
+
+/**
+ * Returns the time spent writing to the stream (in us) and clears it. A blocking stream
+ * stalls in the writes when its buffers are full.
+ */
+uint32_t FirmataClass::takeSendTime(void)
+{
+  uint32_t time = sendTime;
+  sendTime = 0;
+  return time;
+}
+
+/**
+ * Enables or disables the timestamps in front of report messages.
+ */
+void FirmataClass::enableTimestamps(boolean enable)
+{
+  sendTimestamps = enable;
+  timestampBaseSent = false;
+  timestampSent = false;
+}
+
+boolean FirmataClass::timestampsEnabled(void)
+{
+  return sendTimestamps;
+}
+
+/**
+ * Returns micros() extended to 64 bits. Must be called at least once per overflow period
+ * of micros() (about 71 minutes), which is ensured by calling it from the main loop.
+ */
+uint64_t FirmataClass::micros64(void)
+{
+  uint32_t now = micros();
+  if (now < lastMicros) {
+    microsHighWord++;
+  }
+  lastMicros = now;
+  return ((uint64_t)microsHighWord << 32) | now;
+}
+
+/**
+ * If enabled, sends the current time in front of a report message. Normally, this is only a 21 bit
+ * delta to the last base time, a new base time is sent when the delta doesn't fit anymore (about every 2s).
+ * Only the first report message of a pass gets a timestamp, it applies to all report messages of the pass.
+ * The messages are not flushed, as they're always followed by the actual report.
+ */
+void FirmataClass::sendTimestamp(void)
+{
+  if (!sendTimestamps || timestampSent) {
+    return;
+  }
+  timestampSent = true;
+  uint64_t now = micros64();
+  uint64_t delta = now - timestampBase;
+  if (!timestampBaseSent || delta >= (1UL << 21)) {
+    timestampBase = now;
+    timestampBaseSent = true;
+    delta = 0;
+    write(START_SYSEX);
+    write(TIME_SYNC);
+    write(TIME_SYNC_BASE);
+    sendPackedUInt64(now);
+    write(END_SYSEX);
+  }
+  byte msg[7];
+  msg[0] = START_SYSEX;
+  msg[1] = TIME_SYNC;
+  msg[2] = TIME_SYNC_DELTA;
+  msg[3] = (byte)(delta & 0x7F);
+  msg[4] = (byte)((delta >> 7) & 0x7F);
+  msg[5] = (byte)((delta >> 14) & 0x7F);
+  msg[6] = END_SYSEX;
+  write(msg, 7);
+}
+
+/**
+ * Starts a new pass of report messages, the next one gets a new timestamp.
+ */
+void FirmataClass::startTimestampPass(void)
+{
+  timestampSent = false;
 }
 
 /**
@@ -51,7 +163,7 @@ void FirmataClass::startSysex(void)
  */
 void FirmataClass::endSysex(void)
 {
-  FirmataStream->write(END_SYSEX);
+  write(END_SYSEX);
   FirmataStream->flush();
 }
 
@@ -69,6 +181,15 @@ FirmataClass::FirmataClass()
   firmwareVersionMajor = 0;
   firmwareVersionName = "";
   blinkVersionDisabled = false;
+  sendTimestamps = false;
+  timestampBaseSent = false;
+  timestampSent = false;
+  timestampBase = 0;
+  lastMicros = 0;
+  microsHighWord = 0;
+  sendFailures = 0;
+  sendTimeMeasured = false;
+  sendTime = 0;
   systemReset();
 }
 
@@ -124,9 +245,9 @@ void FirmataClass::begin(Stream& s, bool isConsole)
  */
 void FirmataClass::printVersion(void)
 {
-  FirmataStream->write(REPORT_VERSION);
-  FirmataStream->write(FIRMATA_PROTOCOL_MAJOR_VERSION);
-  FirmataStream->write(FIRMATA_PROTOCOL_MINOR_VERSION);
+  write(REPORT_VERSION);
+  write(FIRMATA_PROTOCOL_MAJOR_VERSION);
+  write(FIRMATA_PROTOCOL_MINOR_VERSION);
 }
 
 /**
@@ -168,9 +289,9 @@ void FirmataClass::printFirmwareVersion(void)
 {
     if (firmwareVersionMajor != 0 && FirmataStream != nullptr) { // make sure that the name has been set before reporting
         startSysex();
-        FirmataStream->write(REPORT_FIRMWARE);
-        FirmataStream->write(firmwareVersionMajor); // major version number
-        FirmataStream->write(firmwareVersionMinor); // minor version number
+        write(REPORT_FIRMWARE);
+        write(firmwareVersionMajor); // major version number
+        write(firmwareVersionMinor); // minor version number
         size_t len = strlen(firmwareVersionName);
         for (size_t i = 0; i < len; ++i)
         {
@@ -452,17 +573,18 @@ boolean FirmataClass::isResetting(void)
  */
 void FirmataClass::sendAnalog(byte analogPin, int value)
 {
+    sendTimestamp();
     if (analogPin <= 15)
     {
         // pin can only be 0-15, so chop higher bits
-        FirmataStream->write(ANALOG_MESSAGE | (analogPin & 0xF));
+        write(ANALOG_MESSAGE | (analogPin & 0xF));
         sendValueAsTwo7bitBytes(value);
     }
     else
     {
         startSysex();
-        FirmataStream->write(EXTENDED_ANALOG);
-        FirmataStream->write(analogPin);
+        write(EXTENDED_ANALOG);
+        write(analogPin);
         sendValueAsTwo7bitBytes(value);
         endSysex();
     }
@@ -506,11 +628,12 @@ void FirmataClass::sendDigital(byte pin, int value)
  */
 void FirmataClass::sendDigitalPort(byte portNumber, int portData)
 {
+    sendTimestamp();
     byte msg[3];
     msg[0] = (DIGITAL_MESSAGE | (portNumber & 0xF));
     msg[1] = ((byte)portData % 128); // Tx bits 0-6
     msg[2] = (portData >> 7);  // Tx bits 7-13
-    FirmataStream->write(msg, 3);
+    write(msg, 3);
 }
 
 /**
@@ -524,7 +647,7 @@ void FirmataClass::sendSysex(byte command, byte bytec, byte *bytev)
 {
   byte i;
   startSysex();
-  FirmataStream->write(command);
+  write(command);
   for (i = 0; i < bytec; i++) {
     sendValueAsTwo7bitBytes(bytev[i]);
   }
@@ -568,7 +691,7 @@ void FirmataClass::sendStringf(const FlashString* flashString, ...)
 	char bytesInput[maxSize];
 	char bytesOutput[maxSize];
 	startSysex();
-	FirmataStream->write(STRING_DATA);
+	write(STRING_DATA);
 	for (int i = 0; i < len; i++) 
 	{
 		bytesInput[i] = (pgm_read_byte(((const char*)flashString) + i));
@@ -604,7 +727,7 @@ void FirmataClass::sendString(const FlashString* flashString)
         Serial.println(flashString);
     }
     startSysex();
-    FirmataStream->write(STRING_DATA);
+    write(STRING_DATA);
     for (int i = 0; i < len; i++) 
     {
         sendValueAsTwo7bitBytes(pgm_read_byte(((const char*)flashString) + i));
@@ -628,7 +751,7 @@ void FirmataClass::sendString(const FlashString* flashString, uint32_t errorData
     }
 #endif
     startSysex();
-    FirmataStream->write(STRING_DATA);
+    write(STRING_DATA);
     for (int i = 0; i < len; i++) {
         sendValueAsTwo7bitBytes(pgm_read_byte(((const char*)flashString) + i));
     }
@@ -642,18 +765,33 @@ void FirmataClass::sendString(const FlashString* flashString, uint32_t errorData
 
 
 /**
- * A wrapper for Stream::available().
  * Write a single byte to the output stream.
+ * All output goes through the two write methods, so that writes the stream rejects are counted (see takeSendFailures)
+ * and the time spent sending can be measured (see takeSendTime).
  * @param c The byte to be written.
  */
 void FirmataClass::write(byte c)
 {
-  FirmataStream->write(c);
+  uint32_t start = sendTimeMeasured ? micros() : 0;
+  if (FirmataStream->write(c) == 0 && sendFailures < 0xFFFF) {
+    sendFailures++;
+  }
+  if (sendTimeMeasured) {
+    sendTime += micros() - start;
+  }
 }
 
 size_t FirmataClass::write(byte* buf, size_t length)
 {
-    return FirmataStream->write(buf, length);
+    uint32_t start = sendTimeMeasured ? micros() : 0;
+    size_t written = FirmataStream->write(buf, length);
+    if (written < length && sendFailures < 0xFFFF) {
+      sendFailures++;
+    }
+    if (sendTimeMeasured) {
+      sendTime += micros() - start;
+    }
+    return written;
 }
 
 
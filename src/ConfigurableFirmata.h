@@ -64,6 +64,15 @@
 
 // extended command set using sysex (0-127/0x00-0x7F)
 /* 0x00-0x0F reserved for user-defined commands */
+#define I2C_SCRIPT              0x57 // run a sequence of I2C transfers and reply with all data read
+#define I2C_REPLY_PACKED        0x58 // a reply to an I2C read request, 7 bit encoded, possibly in several chunks
+#define SONAR_DATA              0x59 // configure ultrasonic distance sensors and report their distances
+#define REPORT_TEMPLATE         0x5A // send all configured inputs in one packed frame
+#define TIME_SYNC               0x5B // timestamps and clock synchronization
+#define PATTERN_PLAYBACK        0x5C // play back a table of timed port writes
+#define LOGIC_ANALYZER          0x5D // capture the digital ports at a high rate
+#define DIGITAL_PORTS_WRITE     0x5E // write several digital ports at once
+#define DIGITAL_INPUT_CONFIG    0x5F // configure digital input reporting (change events)
 #define SERIAL_MESSAGE          0x60 // communicate with serial devices, including other boards
 #define ENCODER_DATA            0x61 // reply with encoders current positions
 #define ACCELSTEPPER_DATA       0x62 // control a stepper motor
@@ -91,7 +100,7 @@
 #define REPORT_FIRMWARE         0x79 // report name and version of the firmware
 #define SAMPLING_INTERVAL       0x7A // set the poll rate of the main loop
 #define SCHEDULER_DATA          0x7B // send a createtask/deletetask/addtotask/schedule/querytasks/querytask request to the scheduler
-#define ANALOG_CONFIG           0x7C // (reserved)
+#define ANALOG_CONFIG           0x7C // configure analog input reporting (deadbands, heartbeat)
 #define FREQUENCY_COMMAND       0x7D // Command for the Frequency module
 #define SYSEX_NON_REALTIME      0x7E // MIDI Reserved for non-realtime messages
 #define SYSEX_REALTIME          0x7F // MIDI Reserved for realtime messages
@@ -102,6 +111,13 @@
 #define SYSEX_I2C_REPLY         0x77 // same as I2C_REPLY
 #define SYSEX_SAMPLING_INTERVAL 0x7A // same as SAMPLING_INTERVAL
 
+// TIME_SYNC subcommands
+#define TIME_SYNC_PING          0x00 // request the device time, the payload is echoed
+#define TIME_SYNC_PONG          0x01 // reply: echoed payload + device time in us
+#define TIME_SYNC_ENABLE        0x02 // enable/disable timestamps for report messages
+#define TIME_SYNC_BASE          0x03 // full device time in us, the following deltas refer to it
+#define TIME_SYNC_DELTA         0x04 // 21 bit delta to the base time, applies to the following report messages up to the next delta
+
 // pin modes
 #define PIN_MODE_INPUT          0x00 // INPUT is defined in Arduino.h, but may not be the same as this one
 #define PIN_MODE_OUTPUT         0x01 // OUTPUT is defined in Arduino.h. Careful: OUTPUT is defined as 2 on ESP32!
@@ -118,8 +134,8 @@
 #define PIN_MODE_PULLUP         0x0B // enable internal pull-up resistor for pin
 // Extensions under development
 #define PIN_MODE_SPI            0x0C // pin configured for SPI
-#define PIN_MODE_SONAR =        0x0D // pin configured for HC-SR04
-#define PIN_MODE_TONE =         0x0E // pin configured for tone
+#define PIN_MODE_SONAR          0x0D // pin configured for HC-SR04
+#define PIN_MODE_TONE           0x0E // pin configured for tone
 #define PIN_MODE_DHT            0x0F // pin configured for DHT
 #define PIN_MODE_FREQUENCY      0x10 // pin configured for frequency measurement
 
@@ -188,6 +204,16 @@ class FirmataClass
     void sendString(byte command, const char *string);
     void sendSysex(byte command, byte bytec, byte *bytev);
     void write(byte c);
+    void flush(void);
+    uint16_t takeSendFailures(void);
+    void measureSendTime(boolean enable);
+    uint32_t takeSendTime(void);
+    /* timestamps */
+    void enableTimestamps(boolean enable);
+    boolean timestampsEnabled(void);
+    void sendTimestamp(void);
+    void startTimestampPass(void);
+    uint64_t micros64(void);
 
     size_t write(byte* buf, size_t length);
 
@@ -255,6 +281,18 @@ class FirmataClass
 
     boolean blinkVersionDisabled;
 
+    uint16_t sendFailures; // writes the stream didn't accept since the last call to takeSendFailures()
+    boolean sendTimeMeasured;
+    uint32_t sendTime; // us spent in the writes since the last call to takeSendTime()
+
+    /* timestamps */
+    boolean sendTimestamps;
+    boolean timestampBaseSent;
+    boolean timestampSent; // in the current pass
+    uint64_t timestampBase;
+    uint32_t lastMicros;
+    uint32_t microsHighWord;
+
     /* private methods ------------------------------ */
     void processSysexMessage(void);
     void systemReset(void);
@@ -19,8 +19,31 @@
 #include <ConfigurableFirmata.h>
 #include "DigitalInputFirmata.h"
 
+#ifndef ARDUINO_ISR_ATTR
+#define ARDUINO_ISR_ATTR
+#endif
+
 DigitalInputFirmata *DigitalInputFirmataInstance;
 
+byte DigitalInputFirmata::eventPins[DIGITAL_INPUT_MAX_EVENT_PINS];
+digital_input_event DigitalInputFirmata::eventQueue[DIGITAL_INPUT_EVENT_QUEUE_SIZE];
+volatile byte DigitalInputFirmata::eventHead = 0;
+volatile byte DigitalInputFirmata::eventTail = 0;
+volatile uint16_t DigitalInputFirmata::eventsLost = 0;
+
+// attachInterrupt() doesn't pass an argument to the handler on all cores, therefore there's one handler per slot
+template<byte slot> void ARDUINO_ISR_ATTR DigitalInputFirmata::eventIsr()
+{
+  recordEvent(slot);
+}
+
+void (* const DigitalInputFirmata::eventIsrTable[DIGITAL_INPUT_MAX_EVENT_PINS])() = {
+  eventIsr<0>, eventIsr<1>, eventIsr<2>, eventIsr<3>,
+#if DIGITAL_INPUT_MAX_EVENT_PINS > 4
+  eventIsr<4>, eventIsr<5>, eventIsr<6>, eventIsr<7>,
+#endif
+};
+
 void reportDigitalInputCallback(byte port, int value)
 {
   DigitalInputFirmataInstance->reportDigital(port, value);
@@ -34,19 +57,221 @@ DigitalInputFirmata::DigitalInputFirmata()
     previousPINs[i] = 0;
     reportPINs[i] = 0;
   }
+  memset(debounce, 0, sizeof(debounce));
+  memset(immediatePINs, 0, sizeof(immediatePINs));
+  for (byte i = 0; i < DIGITAL_INPUT_MAX_EVENT_PINS; i++) {
+    eventPins[i] = DIGITAL_INPUT_NO_EVENT_PIN;
+  }
   DigitalInputFirmataInstance = this;
   Firmata.attach(REPORT_DIGITAL, reportDigitalInputCallback);
 }
 
 boolean DigitalInputFirmata::handleSysex(byte command, byte argc, byte* argv)
 {
+  if (command != DIGITAL_INPUT_CONFIG || argc < 1) {
+    return false;
+  }
+  if (argv[0] == DIGITAL_INPUT_CONFIG_EVENTS && argc >= 3) {
+    // Expected: subcommand, pin, enable
+    if (!enableEvents(argv[1], argv[2] != 0)) {
+      Firmata.sendString(F("Change events not possible for this pin"), argv[1]);
+    }
+    return true;
+  }
+  if (argv[0] == DIGITAL_INPUT_CONFIG_DEBOUNCE && argc >= 3) {
+    // Expected: subcommand, pin, mode [, window or sample period in ms (2 bytes)]
+    uint16_t window = argc >= 5 ? Firmata.decodePackedUInt14(argv + 3) : 0;
+    if (!configureDebounce(argv[1], argv[2], window)) {
+      Firmata.sendString(F("Invalid debounce configuration for pin"), argv[1]);
+    }
+    return true;
+  }
+  if (argv[0] == DIGITAL_INPUT_CONFIG_IMMEDIATE && argc >= 3) {
+    // Expected: subcommand, pin, enable
+    byte pin = argv[1];
+    if (pin >= TOTAL_PINS || !IS_PIN_DIGITAL(pin)) {
+      Firmata.sendString(F("Invalid pin for immediate reporting"), pin);
+    } else if (argv[2]) {
+      immediatePINs[pin / 8] |= 1 << (pin & 7);
+    } else {
+      immediatePINs[pin / 8] &= ~(1 << (pin & 7));
+    }
+    return true;
+  }
   return false;
 }
 
-void DigitalInputFirmata::outputPort(byte portNumber, byte portValue, byte forceSend)
+/*
+ * Debouncing is evaluated per port, so the sample period applies to all debounced pins of the same port.
+ * The last configuration wins.
+ */
+boolean DigitalInputFirmata::configureDebounce(byte pin, byte mode, uint16_t window)
+{
+  if (pin >= TOTAL_PINS || !IS_PIN_DIGITAL(pin)) {
+    return false;
+  }
+  byte port = pin / 8;
+  byte bit = 1 << (pin & 7);
+  digital_port_debounce& d = debounce[port];
+  d.count0 &= ~bit;
+  d.count1 &= ~bit;
+  if (mode == DIGITAL_DEBOUNCE_NONE) {
+    d.mask &= ~bit;
+    return true;
+  }
+  if (mode == DIGITAL_DEBOUNCE_COUNT && window <= 65) {
+    // Sampling on every loop would only filter bounces shorter than 4 loop passes
+    d.samplePeriod = (uint16_t)((window > 0 ? window : DIGITAL_DEBOUNCE_COUNT_PERIOD) * 1000);
+  } else if (mode == DIGITAL_DEBOUNCE_TIME && window > 0 && window <= 250) {
+    // 4 samples must agree, so the window is split in 4 (the period must fit in 16 bits)
+    d.samplePeriod = (uint16_t)(window * 250);
+  } else {
+    return false;
+  }
+  // Start from the current level, so that enabling debouncing doesn't cause a report
+  if (readPort(port, bit)) {
+    d.state |= bit;
+  } else {
+    d.state &= ~bit;
+  }
+  d.lastSample = (uint16_t)micros();
+  d.mask |= bit;
+  return true;
+}
+
+/*
+ * Samples all debounced ports that are due. A pin changes its debounced state only after
+ * 4 consecutive samples differ from the current state.
+ */
+void DigitalInputFirmata::sampleDebounce()
+{
+  uint16_t now = (uint16_t)micros();
+  for (byte port = 0; port < TOTAL_PORTS; port++) {
+    digital_port_debounce& d = debounce[port];
+    if (d.mask == 0 || (uint16_t)(now - d.lastSample) < d.samplePeriod) {
+      continue;
+    }
+    d.lastSample = now;
+    byte changed = (readPort(port, d.mask) ^ d.state) & d.mask;
+    // Increment the counters of the changed pins, reset the others
+    d.count1 = (d.count1 ^ d.count0) & changed;
+    d.count0 = ~d.count0 & changed;
+    // A counter that wrapped around to 0 while the pin still differs has seen 4 samples
+    d.state ^= changed & ~(d.count0 | d.count1);
+  }
+}
+
+// Runs in interrupt context. Only the ISRs write the head index, so no locking is required.
+void ARDUINO_ISR_ATTR DigitalInputFirmata::recordEvent(byte slot)
+{
+  uint32_t now = micros();
+  byte pin = eventPins[slot];
+  byte head = eventHead;
+  byte next = (head + 1) & (DIGITAL_INPUT_EVENT_QUEUE_SIZE - 1);
+  if (next == eventTail) {
+    if (eventsLost < 0x3FFF) {
+      eventsLost++;
+    }
+    return;
+  }
+  eventQueue[head].pin = pin;
+  eventQueue[head].level = (byte)digitalRead(PIN_TO_DIGITAL(pin));
+  eventQueue[head].time = now;
+  eventHead = next;
+}
+
+/*
+ * Enables or disables change events for an input pin. The pin must be configured as INPUT or PULLUP
+ * and must support interrupts. Changing the pin mode disables the events again.
+ */
+boolean DigitalInputFirmata::enableEvents(byte pin, bool enable)
+{
+  if (!enable) {
+    disableEvents(pin);
+    return true;
+  }
+  if (pin >= TOTAL_PINS || !IS_PIN_INTERRUPT(pin) || (portConfigInputs[pin / 8] & (1 << (pin & 7))) == 0) {
+    return false;
+  }
+  byte freeSlot = DIGITAL_INPUT_NO_EVENT_PIN;
+  for (byte i = 0; i < DIGITAL_INPUT_MAX_EVENT_PINS; i++) {
+    if (eventPins[i] == pin) {
+      return true;
+    }
+    if (eventPins[i] == DIGITAL_INPUT_NO_EVENT_PIN && freeSlot == DIGITAL_INPUT_NO_EVENT_PIN) {
+      freeSlot = i;
+    }
+  }
+  if (freeSlot == DIGITAL_INPUT_NO_EVENT_PIN) {
+    return false;
+  }
+  eventPins[freeSlot] = pin;
+  attachInterrupt(digitalPinToInterrupt(PIN_TO_DIGITAL(pin)), eventIsrTable[freeSlot], CHANGE);
+  return true;
+}
+
+void DigitalInputFirmata::disableEvents(byte pin)
+{
+  for (byte i = 0; i < DIGITAL_INPUT_MAX_EVENT_PINS; i++) {
+    if (eventPins[i] == pin) {
+      detachInterrupt(digitalPinToInterrupt(PIN_TO_DIGITAL(pin)));
+      eventPins[i] = DIGITAL_INPUT_NO_EVENT_PIN;
+    }
+  }
+}
+
+/*
+ * Sends the queued change events. Format:
+ * START_SYSEX DIGITAL_INPUT_CONFIG DIGITAL_INPUT_EVENT_REPORT lost (2 bytes) timestamp of first event (packed uint32)
+ *   { pin, level, delta to the previous event in us (3 bytes) } END_SYSEX
+ * A new message is started when the delta doesn't fit in 21 bits.
+ */
+void DigitalInputFirmata::reportEvents()
+{
+  while (eventTail != eventHead) {
+    noInterrupts();
+    uint16_t lost = eventsLost;
+    eventsLost = 0;
+    interrupts();
+
+    byte tail = eventTail;
+    uint32_t previousTime = eventQueue[tail].time;
+    Firmata.startSysex();
+    Firmata.write(DIGITAL_INPUT_CONFIG);
+    Firmata.write(DIGITAL_INPUT_EVENT_REPORT);
+    Firmata.sendPackedUInt14(lost);
+    Firmata.sendPackedUInt32(previousTime);
+    for (byte count = 0; count < DIGITAL_INPUT_MAX_EVENTS_PER_REPORT && tail != eventHead; count++) {
+      digital_input_event& event = eventQueue[tail];
+      uint32_t delta = event.time - previousTime;
+      if (delta >= (1UL << 21)) {
+        break;
+      }
+      Firmata.write(event.pin);
+      Firmata.write(event.level);
+      Firmata.write((byte)(delta & 0x7F));
+      Firmata.write((byte)((delta >> 7) & 0x7F));
+      Firmata.write((byte)((delta >> 14) & 0x7F));
+      previousTime = event.time;
+      tail = (tail + 1) & (DIGITAL_INPUT_EVENT_QUEUE_SIZE - 1);
+      // Release the slot only after it has been read
+      eventTail = tail;
+    }
+    Firmata.endSysex();
+  }
+}
+
+byte DigitalInputFirmata::maskPortValue(byte portNumber, byte portValue)
 {
+  // debounced pins report their settled state
+  portValue = (portValue & ~debounce[portNumber].mask) | (debounce[portNumber].state & debounce[portNumber].mask);
   // pins not configured as INPUT are cleared to zeros
-  portValue = portValue & portConfigInputs[portNumber];
+  return portValue & portConfigInputs[portNumber];
+}
+
+void DigitalInputFirmata::outputPort(byte portNumber, byte portValue, byte forceSend)
+{
+  portValue = maskPortValue(portNumber, portValue);
   // only send if the value is different than previously sent
   if (forceSend || previousPINs[portNumber] != portValue) {
     Firmata.sendDigitalPort(portNumber, portValue);
@@ -54,11 +279,47 @@ void DigitalInputFirmata::outputPort(byte portNumber, byte portValue, byte force
   }
 }
 
+/*
+ * Checks the ports with pins flagged as immediate on every loop. A change of such a pin sends
+ * the whole port right away, without waiting for the next sampling interval.
+ */
+void DigitalInputFirmata::reportImmediate()
+{
+  bool sent = false;
+  for (byte i = 0; i < TOTAL_PORTS; i++) {
+    if (immediatePINs[i] == 0 || !reportPINs[i]) {
+      continue;
+    }
+    byte portValue = maskPortValue(i, readPort(i, portConfigInputs[i]));
+    if ((portValue ^ previousPINs[i]) & immediatePINs[i]) {
+      Firmata.sendDigitalPort(i, portValue);
+      previousPINs[i] = portValue;
+      sent = true;
+    }
+  }
+  if (sent) {
+    Firmata.flush();
+  }
+}
+
+bool DigitalInputFirmata::readReportSource(byte sourceType, byte index, int32_t* value)
+{
+  if (sourceType != REPORT_SOURCE_DIGITAL_PORT || index >= TOTAL_PORTS) {
+    return false;
+  }
+  *value = maskPortValue(index, readPort(index, portConfigInputs[index]));
+  return true;
+}
+
 /* -----------------------------------------------------------------------------
  * check all the active digital inputs for change of state, then add any events
  * to the Serial output queue using Serial.print() */
 void DigitalInputFirmata::report(bool elapsed)
 {
+    // Change events are sent as soon as possible, independent of the sampling interval
+    reportEvents();
+    sampleDebounce();
+    reportImmediate();
     if (!elapsed)
     {
         return;
@@ -115,6 +376,9 @@ void DigitalInputFirmata::reportDigital(byte port, int value)
 boolean DigitalInputFirmata::handlePinMode(byte pin, int mode)
 {
   if (IS_PIN_DIGITAL(pin)) {
+    disableEvents(pin);
+    configureDebounce(pin, DIGITAL_DEBOUNCE_NONE, 0);
+    immediatePINs[pin / 8] &= ~(1 << (pin & 7));
     if (mode == PIN_MODE_INPUT || mode == PIN_MODE_PULLUP) {
       portConfigInputs[pin / 8] |= (1 << (pin & 7));
       if (mode == PIN_MODE_INPUT) {
@@ -149,4 +413,13 @@ void DigitalInputFirmata::reset()
     portConfigInputs[i] = 0;    // until activated
     previousPINs[i] = 0;
   }
+  for (byte i = 0; i < DIGITAL_INPUT_MAX_EVENT_PINS; i++) {
+    if (eventPins[i] != DIGITAL_INPUT_NO_EVENT_PIN) {
+      disableEvents(eventPins[i]);
+    }
+  }
+  eventTail = eventHead;
+  eventsLost = 0;
+  memset(debounce, 0, sizeof(debounce));
+  memset(immediatePINs, 0, sizeof(immediatePINs));
 }
@@ -20,6 +20,42 @@
 #include <ConfigurableFirmata.h>
 #include "FirmataFeature.h"
 
+#define DIGITAL_INPUT_CONFIG_EVENTS  0x00 // enable/disable interrupt driven change events for a pin
+#define DIGITAL_INPUT_EVENT_REPORT   0x01 // reply: a list of timestamped pin changes
+#define DIGITAL_INPUT_CONFIG_DEBOUNCE 0x02 // configure debouncing for a pin
+#define DIGITAL_INPUT_CONFIG_IMMEDIATE 0x03 // report changes of a pin on every loop instead of every sampling interval
+
+#define DIGITAL_DEBOUNCE_NONE        0x00
+#define DIGITAL_DEBOUNCE_COUNT       0x01 // a change is accepted after 4 equal samples, taken at least the given period (in ms) apart
+#define DIGITAL_DEBOUNCE_TIME        0x02 // a change is accepted after being stable for the given time (in ms)
+#define DIGITAL_DEBOUNCE_COUNT_PERIOD 1  // default sample period of DIGITAL_DEBOUNCE_COUNT (in ms)
+
+#ifdef LARGE_MEM_DEVICE
+#define DIGITAL_INPUT_MAX_EVENT_PINS    8
+#define DIGITAL_INPUT_EVENT_QUEUE_SIZE  64 // must be a power of two
+#else
+#define DIGITAL_INPUT_MAX_EVENT_PINS    4
+#define DIGITAL_INPUT_EVENT_QUEUE_SIZE  16 // must be a power of two
+#endif
+#define DIGITAL_INPUT_MAX_EVENTS_PER_REPORT 16
+#define DIGITAL_INPUT_NO_EVENT_PIN      0xFF
+
+struct digital_input_event {
+  byte pin;
+  byte level;
+  uint32_t time; // micros() at the time of the interrupt
+};
+
+// Debounce state of a port. Uses 2 bit vertical counters, so that all 8 pins are handled at once
+struct digital_port_debounce {
+  byte mask;    // pins that are debounced
+  byte state;   // debounced value
+  byte count0;  // low bits of the counters
+  byte count1;  // high bits of the counters
+  uint16_t samplePeriod; // in us
+  uint16_t lastSample;
+};
+
 void reportDigitalInputCallback(byte port, int value);
 
 class DigitalInputFirmata: public FirmataFeature
@@ -28,18 +64,40 @@ class DigitalInputFirmata: public FirmataFeature
     DigitalInputFirmata();
     void reportDigital(byte port, int value);
     void report(bool elapsed);
+    bool readReportSource(byte sourceType, byte index, int32_t* value) override;
     void handleCapability(byte pin);
     boolean handleSysex(byte command, byte argc, byte* argv);
     boolean handlePinMode(byte pin, int mode);
     void reset();
 
   private:
+    boolean enableEvents(byte pin, bool enable);
+    void disableEvents(byte pin);
+    void reportEvents();
+    boolean configureDebounce(byte pin, byte mode, uint16_t window);
+    void sampleDebounce();
+    void reportImmediate();
+    byte maskPortValue(byte portNumber, byte portValue);
+
+    template<byte slot> static void eventIsr();
+    static void recordEvent(byte slot);
+    static void (* const eventIsrTable[DIGITAL_INPUT_MAX_EVENT_PINS])();
+
+    /* interrupt driven change events. The queue is written by the ISRs only (head) and read by the main loop only (tail) */
+    static byte eventPins[DIGITAL_INPUT_MAX_EVENT_PINS];
+    static digital_input_event eventQueue[DIGITAL_INPUT_EVENT_QUEUE_SIZE];
+    static volatile byte eventHead;
+    static volatile byte eventTail;
+    static volatile uint16_t eventsLost;
+
     /* digital input ports */
     byte reportPINs[TOTAL_PORTS];       // 1 = report this port, 0 = silence
     byte previousPINs[TOTAL_PORTS];     // previous 8 bits sent
 
     /* pins configuration */
     byte portConfigInputs[TOTAL_PORTS]; // each bit: 1 = pin in INPUT, 0 = anything else
+    digital_port_debounce debounce[TOTAL_PORTS];
+    byte immediatePINs[TOTAL_PORTS];    // each bit: 1 = check pin on every loop
     void outputPort(byte portNumber, byte portValue, byte forceSend);
 };
 
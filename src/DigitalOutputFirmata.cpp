@@ -19,6 +19,11 @@
 #include <ConfigurableFirmata.h>
 #include "DigitalOutputFirmata.h"
 
+#ifdef ESP32
+// noInterrupts() only masks the current core, the spinlock also keeps the other core out
+static portMUX_TYPE writePortsMux = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
 DigitalOutputFirmata *DigitalOutputFirmataInstance;
 
 void digitalOutputWriteCallback(byte port, int value)
@@ -34,61 +39,152 @@ void digitalOutputWriteCallback(byte port, int value)
  */
 void handleSetPinValueCallback(byte pin, int value)
 {
-  if (pin < TOTAL_PINS && IS_PIN_DIGITAL(pin)) {
-    if (Firmata.getPinMode(pin) == PIN_MODE_OUTPUT) {
-      digitalWrite(pin, value);
-      Firmata.setPinState(pin, value);
-    }
-  }
+  DigitalOutputFirmataInstance->setPinValue(pin, value);
 }
 
 DigitalOutputFirmata::DigitalOutputFirmata()
 {
   DigitalOutputFirmataInstance = this;
+  memset(outputPins, 0, sizeof(outputPins));
+  memset(inputPins, 0, sizeof(inputPins));
+  memset(portStates, 0, sizeof(portStates));
   Firmata.attach(DIGITAL_MESSAGE, digitalOutputWriteCallback);
   Firmata.attach(SET_DIGITAL_PIN_VALUE, handleSetPinValueCallback);
 }
 
 boolean DigitalOutputFirmata::handleSysex(byte command, byte argc, byte* argv)
 {
+  if (command == DIGITAL_PORTS_WRITE) {
+    writePorts(argc, argv);
+    return true;
+  }
   return false;
 }
 
+/*
+ * Writes several ports with interrupts disabled, so that all outputs change (almost) at the same time.
+ * Format: { port, value (2 bytes), mask (2 bytes) } repeated. Only pins in OUTPUT mode are written.
+ */
+void DigitalOutputFirmata::writePorts(byte argc, byte* argv)
+{
+  if (argc == 0 || argc % 5 != 0) {
+    Firmata.sendString(F("Invalid length of multi-port write"), argc);
+    return;
+  }
+  for (byte i = 0; i < argc; i += 5) {
+    if (argv[i] >= TOTAL_PORTS) {
+      Firmata.sendString(F("Invalid port number"), argv[i]);
+      return;
+    }
+  }
+
+#ifdef ESP32
+  portENTER_CRITICAL(&writePortsMux);
+#else
+  noInterrupts();
+#endif
+  for (byte i = 0; i < argc; i += 5) {
+    byte port = argv[i];
+    byte value = argv[i + 1] | (argv[i + 2] << 7);
+    byte mask = argv[i + 3] | (argv[i + 4] << 7);
+    writePort(port, value, mask & outputPins[port]);
+  }
+#ifdef ESP32
+  portEXIT_CRITICAL(&writePortsMux);
+#else
+  interrupts();
+#endif
+
+  for (byte i = 0; i < argc; i += 5) {
+    byte port = argv[i];
+    byte value = argv[i + 1] | (argv[i + 2] << 7);
+    byte mask = argv[i + 3] | (argv[i + 4] << 7);
+    updatePinStates(port, value, mask & outputPins[port]);
+  }
+}
+
+/*
+ * Picks up the pin modes from Firmata. This isn't done in the constructor, because a global instance
+ * may be constructed before Firmata.
+ */
 void DigitalOutputFirmata::reset()
 {
+  for (byte pin = 0; pin < TOTAL_PINS; pin++) {
+    updatePinMasks(pin, Firmata.getPinMode(pin));
+  }
+}
 
+void DigitalOutputFirmata::setPinValue(byte pin, int value)
+{
+  if (pin < TOTAL_PINS && IS_PIN_DIGITAL(pin)) {
+    if (Firmata.getPinMode(pin) == PIN_MODE_OUTPUT) {
+      digitalWrite(pin, value);
+      Firmata.setPinState(pin, value);
+      if (value) {
+        portStates[pin / 8] |= 1 << (pin & 7);
+      } else {
+        portStates[pin / 8] &= ~(1 << (pin & 7));
+      }
+    }
+  }
 }
 
 void DigitalOutputFirmata::digitalWritePort(byte port, int value)
 {
-  byte pin, lastPin, pinValue, mask = 1, pinWriteMask = 0;
-
-  if (port < TOTAL_PORTS) {
-    // create a mask of the pins on this port that are writable.
-    lastPin = port * 8 + 8;
-    if (lastPin > TOTAL_PINS) lastPin = TOTAL_PINS;
-    for (pin = port * 8; pin < lastPin; pin++) {
-      // do not disturb non-digital pins (eg, Rx & Tx)
-      if (IS_PIN_DIGITAL(pin)) {
-        // do not touch pins in PWM, ANALOG, SERVO or other modes
-        if (Firmata.getPinMode(pin) == PIN_MODE_OUTPUT || Firmata.getPinMode(pin) == INPUT) {
-          pinValue = ((byte)value & mask) ? 1 : 0;
-          if (Firmata.getPinMode(pin) == PIN_MODE_OUTPUT) {
-            pinWriteMask |= mask;
-          } else if (Firmata.getPinMode(pin) == INPUT && pinValue == 1 && Firmata.getPinState(pin) != 1) {
-            pinMode(pin, INPUT_PULLUP);
-          }
-          Firmata.setPinState(pin, pinValue);
-        }
-      }
-      mask = mask << 1;
+  if (port >= TOTAL_PORTS) {
+    return;
+  }
+  // pins in PWM, ANALOG, SERVO or other modes and non-digital pins (eg, Rx & Tx) are not part of the masks
+  byte portValue = (byte)value;
+  byte writablePins = outputPins[port] | inputPins[port];
+  // input pins that are set to 1 for the first time get their pull-up enabled
+  byte pullups = inputPins[port] & portValue & ~portStates[port];
+
+  writePort(port, portValue, outputPins[port]);
+
+  byte pin = port * 8;
+  for (byte bits = pullups; bits != 0; bits >>= 1, pin++) {
+    if (bits & 1) {
+      pinMode(PIN_TO_DIGITAL(pin), INPUT_PULLUP);
+    }
+  }
+  updatePinStates(port, portValue, writablePins);
+}
+
+void DigitalOutputFirmata::updatePinStates(byte port, byte portValue, byte pins)
+{
+  // Only the pins that actually changed need their state updated, usually that's just a few
+  byte changed = (portValue ^ portStates[port]) & pins;
+  byte pin = port * 8;
+  for (byte bits = changed; bits != 0; bits >>= 1, pin++) {
+    if (bits & 1) {
+      Firmata.setPinState(pin, (portValue >> (pin & 7)) & 1);
     }
-    writePort(port, (byte)value, pinWriteMask);
+  }
+  portStates[port] = (portStates[port] & ~pins) | (portValue & pins);
+}
+
+void DigitalOutputFirmata::updatePinMasks(byte pin, int mode)
+{
+  if (pin >= TOTAL_PINS || !IS_PIN_DIGITAL(pin)) {
+    return;
+  }
+  byte port = pin / 8;
+  byte mask = 1 << (pin & 7);
+  outputPins[port] &= ~mask;
+  inputPins[port] &= ~mask;
+  // setPinMode() resets the pin state
+  portStates[port] &= ~mask;
+  if (mode == PIN_MODE_OUTPUT) {
+    outputPins[port] |= mask;
+  } else if (mode == PIN_MODE_INPUT) {
+    inputPins[port] |= mask;
   }
 }
 
 boolean DigitalOutputFirmata::handlePinMode(byte pin, int mode)
 {
+  updatePinMasks(pin, mode);
   if (IS_PIN_DIGITAL(pin) && mode == PIN_MODE_OUTPUT && Firmata.getPinMode(pin) != PIN_MODE_IGNORE) {
     digitalWrite(PIN_TO_DIGITAL(pin), LOW); // disable PWM
     pinMode(PIN_TO_DIGITAL(pin), OUTPUT);
@@ -30,11 +30,20 @@ class DigitalOutputFirmata: public FirmataFeature
   public:
     DigitalOutputFirmata();
     void digitalWritePort(byte port, int value);
+    void setPinValue(byte pin, int value);
     void handleCapability(byte pin);
     boolean handleSysex(byte command, byte argc, byte* argv);
     boolean handlePinMode(byte pin, int mode);
     void reset();
   private:
+    void updatePinMasks(byte pin, int mode);
+    void updatePinStates(byte port, byte portValue, byte pins);
+    void writePorts(byte argc, byte* argv);
+
+    /* kept up to date from handlePinMode(), so that a port write doesn't need to look at each pin */
+    byte outputPins[TOTAL_PORTS];       // each bit: 1 = pin in OUTPUT mode
+    byte inputPins[TOTAL_PORTS];        // each bit: 1 = pin in INPUT mode (writing a 1 enables the pull-up)
+    byte portStates[TOTAL_PORTS];       // last value written to the OUTPUT and INPUT pins (same as the pin state)
 };
 
 #endif
@@ -0,0 +1,412 @@
+/*
+  EncoderFirmata.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <ConfigurableFirmata.h>
+#include "EncoderFirmata.h"
+
+#ifndef ARDUINO_ISR_ATTR
+#define ARDUINO_ISR_ATTR
+#endif
+
+// Position change for (previous A, previous B, A, B). Invalid transitions (both pins changed) count as 0.
+static const int8_t quadratureTable[16] = { 0, -1, 1, 0, 1, 0, 0, -1, -1, 0, 0, 1, 0, 1, -1, 0 };
+
+byte EncoderFirmata::isrPinA[MAX_ENCODERS];
+byte EncoderFirmata::isrPinB[MAX_ENCODERS];
+byte EncoderFirmata::isrState[MAX_ENCODERS];
+bool EncoderFirmata::isrFullStep[MAX_ENCODERS];
+volatile int32_t EncoderFirmata::positions[MAX_ENCODERS];
+
+// attachInterrupt() doesn't pass an argument to the handler on all cores, therefore there's one handler per encoder
+template<byte encoder> void ARDUINO_ISR_ATTR EncoderFirmata::encoderIsr()
+{
+  updatePosition(encoder);
+}
+
+void (* const EncoderFirmata::isrTable[MAX_ENCODERS])() = {
+  encoderIsr<0>, encoderIsr<1>, encoderIsr<2>, encoderIsr<3>,
+#if MAX_ENCODERS > 4
+  encoderIsr<4>, encoderIsr<5>, encoderIsr<6>, encoderIsr<7>,
+#endif
+};
+
+void ARDUINO_ISR_ATTR EncoderFirmata::updatePosition(byte encoder)
+{
+  byte a = digitalRead(isrPinA[encoder]) == HIGH ? 1 : 0;
+  byte b = digitalRead(isrPinB[encoder]) == HIGH ? 1 : 0;
+  byte state = (a << 1) | b;
+  if (isrFullStep[encoder]) {
+    positions[encoder] += quadratureTable[(isrState[encoder] << 2) | state];
+  } else if ((isrState[encoder] >> 1) != a) {
+    // Only A has an interrupt: A changing to a different level than B is a step forward
+    positions[encoder] += a != b ? 1 : -1;
+  }
+  isrState[encoder] = state;
+}
+
+EncoderFirmata::EncoderFirmata()
+{
+  for (byte i = 0; i < MAX_ENCODERS; i++) {
+    encoders[i].attached = false;
+    encoders[i].hardware = false;
+    positions[i] = 0;
+  }
+  autoReport = ENCODER_AUTO_OFF;
+  reportVelocity = false;
+}
+
+void EncoderFirmata::handleCapability(byte pin)
+{
+  if (IS_PIN_DIGITAL(pin) && digitalPinToInterrupt(pin) >= 0) {
+    Firmata.write(PIN_MODE_ENCODER);
+    Firmata.write(28); // 28 bits used for absolute position
+  }
+}
+
+boolean EncoderFirmata::handlePinMode(byte pin, int mode)
+{
+  if (!IS_PIN_DIGITAL(pin)) {
+    return false;
+  }
+  if (mode == PIN_MODE_ENCODER) {
+    return true;
+  }
+  for (byte i = 0; i < MAX_ENCODERS; i++) {
+    if (encoders[i].attached && (encoders[i].pinA == pin || encoders[i].pinB == pin)) {
+      detachEncoder(i);
+    }
+  }
+  return false;
+}
+
+boolean EncoderFirmata::handleSysex(byte command, byte argc, byte* argv)
+{
+  if (command != ENCODER_DATA || argc < 1) {
+    return false;
+  }
+  byte encoder = argc > 1 ? argv[1] : 0;
+  switch (argv[0]) {
+    case ENCODER_ATTACH:
+      if (argc < 4) {
+        Firmata.sendString(F("Error in encoder command: Not enough parameters"));
+        return true;
+      }
+      attachEncoder(encoder, argv[2], argv[3]);
+      return true;
+    case ENCODER_REPORT_POSITION:
+      if (argc > 1 && encoder < MAX_ENCODERS && encoders[encoder].attached) {
+        Firmata.sendTimestamp();
+        Firmata.startSysex();
+        Firmata.write(ENCODER_DATA);
+        reportPosition(encoder);
+        Firmata.endSysex();
+      }
+      return true;
+    case ENCODER_REPORT_POSITIONS:
+      reportPositions(false);
+      return true;
+    case ENCODER_RESET_POSITION:
+      if (argc > 1 && encoder < MAX_ENCODERS && encoders[encoder].attached) {
+        resetPosition(encoder);
+      }
+      return true;
+    case ENCODER_REPORT_AUTO:
+      if (argc > 1) {
+        autoReport = argv[1] <= ENCODER_AUTO_ON_CHANGE ? argv[1] : ENCODER_AUTO_PERIODIC;
+      }
+      return true;
+    case ENCODER_DETACH:
+      if (argc > 1 && encoder < MAX_ENCODERS && encoders[encoder].attached) {
+        detachEncoder(encoder);
+      }
+      return true;
+    case ENCODER_REPORT_VELOCITY:
+      if (argc > 1) {
+        reportVelocity = argv[1] != 0;
+        for (byte i = 0; i < MAX_ENCODERS; i++) {
+          if (encoders[i].attached) {
+            encoders[i].lastVelocityPosition = readPosition(i);
+            encoders[i].lastVelocityTime = micros();
+          }
+        }
+      }
+      return true;
+  }
+  return false;
+}
+
+void EncoderFirmata::attachEncoder(byte encoder, byte pinA, byte pinB)
+{
+  if (encoder >= MAX_ENCODERS) {
+    Firmata.sendString(F("Invalid encoder number"), encoder);
+    return;
+  }
+  if (pinA >= TOTAL_PINS || pinB >= TOTAL_PINS || !IS_PIN_DIGITAL(pinA) || !IS_PIN_DIGITAL(pinB) || pinA == pinB) {
+    Firmata.sendString(F("Invalid encoder pins"));
+    return;
+  }
+  if (digitalPinToInterrupt(pinA) < 0) {
+    Firmata.sendString(F("Encoder pin A must support interrupts"), pinA);
+    return;
+  }
+  for (byte i = 0; i < MAX_ENCODERS; i++) {
+    encoder_info& other = encoders[i];
+    if (other.attached && (i == encoder || other.pinA == pinA || other.pinA == pinB || other.pinB == pinA || other.pinB == pinB)) {
+      detachEncoder(i);
+    }
+  }
+
+  Firmata.setPinMode(pinA, PIN_MODE_ENCODER);
+  Firmata.setPinMode(pinB, PIN_MODE_ENCODER);
+  pinMode(pinA, INPUT_PULLUP);
+  pinMode(pinB, INPUT_PULLUP);
+
+  encoder_info& info = encoders[encoder];
+  info.pinA = pinA;
+  info.pinB = pinB;
+  info.lastReported = 0;
+  info.lastVelocityPosition = 0;
+  info.lastVelocityTime = micros();
+  info.hardware = startHardwareDecoder(encoder);
+  if (!info.hardware) {
+    isrPinA[encoder] = pinA;
+    isrPinB[encoder] = pinB;
+    isrState[encoder] = (digitalRead(pinA) == HIGH ? 2 : 0) | (digitalRead(pinB) == HIGH ? 1 : 0);
+    isrFullStep[encoder] = digitalPinToInterrupt(pinB) >= 0;
+    noInterrupts();
+    positions[encoder] = 0;
+    interrupts();
+    attachInterrupt(digitalPinToInterrupt(pinA), isrTable[encoder], CHANGE);
+    if (isrFullStep[encoder]) {
+      attachInterrupt(digitalPinToInterrupt(pinB), isrTable[encoder], CHANGE);
+    }
+  }
+  info.attached = true;
+}
+
+void EncoderFirmata::detachEncoder(byte encoder)
+{
+  encoder_info& info = encoders[encoder];
+  if (info.hardware) {
+    stopHardwareDecoder(encoder);
+    info.hardware = false;
+  } else {
+    detachInterrupt(digitalPinToInterrupt(info.pinA));
+    if (isrFullStep[encoder]) {
+      detachInterrupt(digitalPinToInterrupt(info.pinB));
+    }
+  }
+  info.attached = false;
+}
+
+#ifdef ENCODER_HW_DECODER_PCNT
+
+/*
+ * Full quadrature decoding with two PCNT channels: each pin counts on its edges, the direction
+ * depends on the level of the other pin. The driver extends the 16 bit counter in software.
+ */
+bool EncoderFirmata::startHardwareDecoder(byte encoder)
+{
+  encoder_info& info = encoders[encoder];
+  pcnt_unit_config_t unitConfig = {};
+  unitConfig.low_limit = -INT16_MAX;
+  unitConfig.high_limit = INT16_MAX;
+  unitConfig.flags.accum_count = 1;
+  if (pcnt_new_unit(&unitConfig, &pcntUnits[encoder]) != ESP_OK) {
+    return false;
+  }
+  pcnt_chan_config_t channelConfig = {};
+  channelConfig.edge_gpio_num = info.pinA;
+  channelConfig.level_gpio_num = info.pinB;
+  if (pcnt_new_channel(pcntUnits[encoder], &channelConfig, &pcntChannels[encoder][0]) != ESP_OK) {
+    pcnt_del_unit(pcntUnits[encoder]);
+    return false;
+  }
+  channelConfig.edge_gpio_num = info.pinB;
+  channelConfig.level_gpio_num = info.pinA;
+  if (pcnt_new_channel(pcntUnits[encoder], &channelConfig, &pcntChannels[encoder][1]) != ESP_OK) {
+    pcnt_del_channel(pcntChannels[encoder][0]);
+    pcnt_del_unit(pcntUnits[encoder]);
+    return false;
+  }
+  // Same direction convention as the quadrature table: A rising while B is low counts up
+  pcnt_channel_set_edge_action(pcntChannels[encoder][0], PCNT_CHANNEL_EDGE_ACTION_DECREASE, PCNT_CHANNEL_EDGE_ACTION_INCREASE);
+  pcnt_channel_set_level_action(pcntChannels[encoder][0], PCNT_CHANNEL_LEVEL_ACTION_KEEP, PCNT_CHANNEL_LEVEL_ACTION_INVERSE);
+  pcnt_channel_set_edge_action(pcntChannels[encoder][1], PCNT_CHANNEL_EDGE_ACTION_INCREASE, PCNT_CHANNEL_EDGE_ACTION_DECREASE);
+  pcnt_channel_set_level_action(pcntChannels[encoder][1], PCNT_CHANNEL_LEVEL_ACTION_KEEP, PCNT_CHANNEL_LEVEL_ACTION_INVERSE);
+  pcnt_unit_add_watch_point(pcntUnits[encoder], INT16_MAX);
+  pcnt_unit_add_watch_point(pcntUnits[encoder], -INT16_MAX);
+  pcnt_unit_enable(pcntUnits[encoder]);
+  pcnt_unit_clear_count(pcntUnits[encoder]);
+  pcnt_unit_start(pcntUnits[encoder]);
+  return true;
+}
+
+void EncoderFirmata::stopHardwareDecoder(byte encoder)
+{
+  pcnt_unit_stop(pcntUnits[encoder]);
+  pcnt_unit_disable(pcntUnits[encoder]);
+  pcnt_unit_remove_watch_point(pcntUnits[encoder], INT16_MAX);
+  pcnt_unit_remove_watch_point(pcntUnits[encoder], -INT16_MAX);
+  pcnt_del_channel(pcntChannels[encoder][0]);
+  pcnt_del_channel(pcntChannels[encoder][1]);
+  pcnt_del_unit(pcntUnits[encoder]);
+}
+
+#else
+
+bool EncoderFirmata::startHardwareDecoder(byte encoder)
+{
+  return false;
+}
+
+void EncoderFirmata::stopHardwareDecoder(byte encoder)
+{
+}
+
+#endif
+
+int32_t EncoderFirmata::readPosition(byte encoder)
+{
+#ifdef ENCODER_HW_DECODER_PCNT
+  if (encoders[encoder].hardware) {
+    int count = 0;
+    pcnt_unit_get_count(pcntUnits[encoder], &count);
+    return count;
+  }
+#endif
+  noInterrupts();
+  int32_t position = positions[encoder];
+  interrupts();
+  return position;
+}
+
+void EncoderFirmata::resetPosition(byte encoder)
+{
+#ifdef ENCODER_HW_DECODER_PCNT
+  if (encoders[encoder].hardware) {
+    pcnt_unit_clear_count(pcntUnits[encoder]);
+  }
+#endif
+  noInterrupts();
+  positions[encoder] = 0;
+  interrupts();
+  encoders[encoder].lastVelocityPosition = 0;
+}
+
+bool EncoderFirmata::readReportSource(byte sourceType, byte index, int32_t* value)
+{
+  if (sourceType != REPORT_SOURCE_ENCODER || index >= MAX_ENCODERS || !encoders[index].attached) {
+    return false;
+  }
+  *value = readPosition(index);
+  return true;
+}
+
+// Sign (bit 6) and encoder number, followed by the absolute value in 4 x 7 bits
+void EncoderFirmata::writePosition(byte encoder, int32_t position)
+{
+  uint32_t absValue = position >= 0 ? (uint32_t)position : (uint32_t)-position;
+  byte direction = position >= 0 ? 0x00 : 0x01;
+  Firmata.write((direction << 6) | encoder);
+  Firmata.write((byte)absValue & 0x7F);
+  Firmata.write((byte)(absValue >> 7) & 0x7F);
+  Firmata.write((byte)(absValue >> 14) & 0x7F);
+  Firmata.write((byte)(absValue >> 21) & 0x7F);
+}
+
+void EncoderFirmata::reportPosition(byte encoder)
+{
+  int32_t position = readPosition(encoder);
+  encoders[encoder].lastReported = position;
+  writePosition(encoder, position);
+}
+
+void EncoderFirmata::reportPositions(bool changedOnly)
+{
+  bool started = false;
+  for (byte i = 0; i < MAX_ENCODERS; i++) {
+    if (!encoders[i].attached || (changedOnly && readPosition(i) == encoders[i].lastReported)) {
+      continue;
+    }
+    if (!started) {
+      Firmata.sendTimestamp();
+      Firmata.startSysex();
+      Firmata.write(ENCODER_DATA);
+      started = true;
+    }
+    reportPosition(i);
+  }
+  if (started) {
+    Firmata.endSysex();
+  }
+}
+
+/*
+ * Format: ENCODER_VELOCITY_DATA, then for each encoder its number and the velocity in steps per second
+ * (sign and 4 x 7 bits, like the positions), averaged over the last sampling interval.
+ */
+void EncoderFirmata::reportVelocities()
+{
+  bool started = false;
+  uint32_t now = micros();
+  for (byte i = 0; i < MAX_ENCODERS; i++) {
+    encoder_info& info = encoders[i];
+    if (!info.attached) {
+      continue;
+    }
+    int32_t position = readPosition(i);
+    uint32_t elapsedMicros = now - info.lastVelocityTime;
+    int32_t velocity = 0;
+    if (elapsedMicros > 0) {
+      velocity = (int32_t)((int64_t)(position - info.lastVelocityPosition) * 1000000 / elapsedMicros);
+    }
+    info.lastVelocityPosition = position;
+    info.lastVelocityTime = now;
+    if (!started) {
+      Firmata.sendTimestamp();
+      Firmata.startSysex();
+      Firmata.write(ENCODER_DATA);
+      Firmata.write(ENCODER_VELOCITY_DATA);
+      started = true;
+    }
+    writePosition(i, velocity);
+  }
+  if (started) {
+    Firmata.endSysex();
+  }
+}
+
+void EncoderFirmata::report(bool elapsed)
+{
+  if (!elapsed) {
+    return;
+  }
+  if (autoReport == ENCODER_AUTO_PERIODIC) {
+    reportPositions(false);
+  } else if (autoReport == ENCODER_AUTO_ON_CHANGE) {
+    reportPositions(true);
+  }
+  if (reportVelocity) {
+    reportVelocities();
+  }
+}
+
+void EncoderFirmata::reset()
+{
+  for (byte i = 0; i < MAX_ENCODERS; i++) {
+    if (encoders[i].attached) {
+      detachEncoder(i);
+    }
+  }
+  autoReport = ENCODER_AUTO_OFF;
+  reportVelocity = false;
+}
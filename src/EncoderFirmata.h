@@ -0,0 +1,107 @@
+/*
+  EncoderFirmata.h - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef EncoderFirmata_h
+#define EncoderFirmata_h
+
+#include <ConfigurableFirmata.h>
+#include "FirmataFeature.h"
+
+#define ENCODER_ATTACH              0x00 // encoder number, pin A, pin B
+#define ENCODER_REPORT_POSITION     0x01 // encoder number
+#define ENCODER_REPORT_POSITIONS    0x02
+#define ENCODER_RESET_POSITION      0x03 // encoder number
+#define ENCODER_REPORT_AUTO         0x04 // one of ENCODER_AUTO_*
+#define ENCODER_DETACH              0x05 // encoder number
+#define ENCODER_REPORT_VELOCITY     0x06 // enable/disable velocity reports
+
+#define ENCODER_AUTO_OFF            0x00
+#define ENCODER_AUTO_PERIODIC       0x01 // all encoders every sampling interval
+#define ENCODER_AUTO_ON_CHANGE      0x02 // only encoders whose position changed
+
+// Position replies start with the encoder number (and the sign in bit 6), velocity replies with this marker
+#define ENCODER_VELOCITY_DATA       0x10
+
+#ifdef LARGE_MEM_DEVICE
+#define MAX_ENCODERS                8
+#else
+#define MAX_ENCODERS                4
+#endif
+
+// PCNT units decode quadrature signals in hardware on the ESP32, other boards use an interrupt per edge
+#if defined(ESP32) && defined(__has_include)
+#if __has_include(<driver/pulse_cnt.h>)
+#include <driver/pulse_cnt.h>
+#include <soc/soc_caps.h>
+#if SOC_PCNT_SUPPORTED
+#define ENCODER_HW_DECODER_PCNT 1
+#endif
+#endif
+#endif
+
+struct encoder_info {
+  byte pinA;
+  byte pinB;
+  bool attached;
+  bool hardware;          // decoded by a PCNT unit
+  int32_t lastReported;   // position sent in the last on-change report
+  int32_t lastVelocityPosition;
+  uint32_t lastVelocityTime;
+};
+
+/*
+ * Decodes quadrature encoders. Pin A must support interrupts. If pin B does as well, all four edges
+ * of a cycle are counted, otherwise only the edges of pin A are (half resolution).
+ */
+class EncoderFirmata: public FirmataFeature
+{
+  public:
+    EncoderFirmata();
+    void handleCapability(byte pin);
+    boolean handlePinMode(byte pin, int mode);
+    boolean handleSysex(byte command, byte argc, byte* argv);
+    void report(bool elapsed);
+    void reset();
+    bool readReportSource(byte sourceType, byte index, int32_t* value) override;
+
+  private:
+    void attachEncoder(byte encoder, byte pinA, byte pinB);
+    void detachEncoder(byte encoder);
+    int32_t readPosition(byte encoder);
+    void resetPosition(byte encoder);
+    void writePosition(byte encoder, int32_t position);
+    void reportPosition(byte encoder);
+    void reportPositions(bool changedOnly);
+    void reportVelocities();
+    bool startHardwareDecoder(byte encoder);
+    void stopHardwareDecoder(byte encoder);
+
+    template<byte encoder> static void encoderIsr();
+    static void (* const isrTable[MAX_ENCODERS])();
+    static void updatePosition(byte encoder);
+
+    encoder_info encoders[MAX_ENCODERS];
+    byte autoReport;
+    bool reportVelocity;
+#ifdef ENCODER_HW_DECODER_PCNT
+    pcnt_unit_handle_t pcntUnits[MAX_ENCODERS];
+    pcnt_channel_handle_t pcntChannels[MAX_ENCODERS][2];
+#endif
+
+    /* decoder state, written by the ISRs */
+    static byte isrPinA[MAX_ENCODERS];
+    static byte isrPinB[MAX_ENCODERS];
+    static byte isrState[MAX_ENCODERS];   // last levels of A (bit 1) and B (bit 0)
+    static bool isrFullStep[MAX_ENCODERS]; // true if both pins have interrupts
+    static volatile int32_t positions[MAX_ENCODERS];
+};
+
+#endif
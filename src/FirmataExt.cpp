@@ -45,6 +45,7 @@ FirmataExt::FirmataExt()
         features[i] = nullptr;
     }
   numFeatures = 0;
+  reportTemplateLength = 0;
 }
 
 void FirmataExt::handleCapability(byte pin)
@@ -133,6 +134,12 @@ boolean FirmataExt::handleSysex(byte command, byte argc, byte* argv)
             Firmata.write(END_SYSEX);
 	    }
         return true;
+    case REPORT_TEMPLATE:
+      if (argc > 0 && argv[0] == REPORT_TEMPLATE_SET) {
+        setReportTemplate(argc - 1, argv + 1);
+        return true;
+      }
+      break;
     default:
       for (byte i = 0; i < numFeatures; i++) {
         if (features[i]->handleSysex(command, argc, argv)) {
@@ -153,6 +160,7 @@ void FirmataExt::addFeature(FirmataFeature &capability)
 
 void FirmataExt::reset()
 {
+  reportTemplateLength = 0;
   for (byte i = 0; i < numFeatures; i++) {
     features[i]->reset();
   }
@@ -160,9 +168,106 @@ void FirmataExt::reset()
 
 void FirmataExt::report(bool elapsed)
 {
+  // All report messages of the pass share one timestamp
+  Firmata.startTimestampPass();
   for (byte i = 0; i < numFeatures; i++) {
     features[i]->report(elapsed);
   }
+  if (elapsed && reportTemplateLength > 0) {
+    sendReportFrame();
+  }
+  // Replies sent while processing the input get their own timestamp
+  Firmata.startTimestampPass();
+}
+
+/*
+ * Format: a list of (source type, index, number of bits) triples. The individual reports of the
+ * sources (REPORT_ANALOG, REPORT_DIGITAL, ...) are not changed; the host should disable them.
+ * Only continuous I2C reads are implicitly silenced while they're part of the template.
+ */
+void FirmataExt::setReportTemplate(byte argc, byte* argv)
+{
+  clearReportTemplate();
+  if (argc % 3 != 0 || argc / 3 > MAX_REPORT_TEMPLATE_ENTRIES) {
+    Firmata.sendString(F("Invalid report template length"), argc);
+    return;
+  }
+  for (byte i = 0; i < argc; i += 3) {
+    report_template_entry& entry = reportTemplate[i / 3];
+    entry.sourceType = argv[i];
+    entry.index = argv[i + 1];
+    entry.bits = argv[i + 2];
+    int32_t value;
+    if (entry.bits == 0 || entry.bits > 32 || !readReportSource(entry.sourceType, entry.index, &value)) {
+      Firmata.sendString(F("Invalid report template source"), i / 3);
+      clearReportTemplate();
+      return;
+    }
+  }
+  reportTemplateLength = argc / 3;
+}
+
+void FirmataExt::clearReportTemplate()
+{
+  reportTemplateLength = 0;
+  for (byte i = 0; i < numFeatures; i++) {
+    features[i]->reportTemplateChanged();
+  }
+}
+
+bool FirmataExt::readReportSource(byte sourceType, byte index, int32_t* value)
+{
+  for (byte i = 0; i < numFeatures; i++) {
+    if (features[i]->readReportSource(sourceType, index, value)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * The values are packed without any gaps, in template order and starting with the lowest bit
+ * of the first value, 7 bits per byte. Negative values are sent in two's complement.
+ * If a source doesn't exist anymore (e.g. a stopped I2C query), the template is cleared instead.
+ */
+void FirmataExt::sendReportFrame()
+{
+  int32_t values[MAX_REPORT_TEMPLATE_ENTRIES];
+  for (byte i = 0; i < reportTemplateLength; i++) {
+    values[i] = 0;
+    if (!readReportSource(reportTemplate[i].sourceType, reportTemplate[i].index, &values[i])) {
+      Firmata.sendString(F("Report template source removed, template cleared"), i);
+      clearReportTemplate();
+      return;
+    }
+  }
+  Firmata.sendTimestamp();
+  Firmata.startSysex();
+  Firmata.write(REPORT_TEMPLATE);
+  Firmata.write(REPORT_TEMPLATE_FRAME);
+  uint16_t accumulator = 0;
+  byte accumulatedBits = 0;
+  for (byte i = 0; i < reportTemplateLength; i++) {
+    const report_template_entry& entry = reportTemplate[i];
+    uint32_t bitsToSend = (uint32_t)values[i];
+    byte remaining = entry.bits;
+    while (remaining > 0) {
+      byte chunk = remaining < 7 ? remaining : 7;
+      accumulator |= (uint16_t)(bitsToSend & ((1 << chunk) - 1)) << accumulatedBits;
+      accumulatedBits += chunk;
+      bitsToSend >>= chunk;
+      remaining -= chunk;
+      if (accumulatedBits >= 7) {
+        Firmata.write((byte)(accumulator & 0x7F));
+        accumulator >>= 7;
+        accumulatedBits -= 7;
+      }
+    }
+  }
+  if (accumulatedBits > 0) {
+    Firmata.write((byte)accumulator);
+  }
+  Firmata.endSysex();
 }
 
 bool FirmataExt::handleSystemVariableQuery(bool write, SystemVariableDataType* data_type, int variable_id, byte pin, SystemVariableError* status, int* value)
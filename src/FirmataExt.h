@@ -22,6 +22,21 @@
 
 #define MAX_FEATURES TOTAL_PIN_MODES + 5
 
+#define REPORT_TEMPLATE_SET         0x00 // set the list of sources, an empty list disables the template
+#define REPORT_TEMPLATE_FRAME       0x01 // reply: the values of all sources
+
+#ifdef LARGE_MEM_DEVICE
+#define MAX_REPORT_TEMPLATE_ENTRIES 64
+#else
+#define MAX_REPORT_TEMPLATE_ENTRIES 16
+#endif
+
+struct report_template_entry {
+  byte sourceType; // one of REPORT_SOURCE_*
+  byte index;
+  byte bits;       // number of (low) bits of the value sent, 1-32
+};
+
 void handleSetPinModeCallback(byte pin, int mode);
 
 void handleSysexCallback(byte command, byte argc, byte* argv);
@@ -41,6 +56,14 @@ class FirmataExt: public FirmataFeature
   private:
     FirmataFeature *features[MAX_FEATURES];
     byte numFeatures;
+
+    /* report template: all values are sent in one bit-packed frame per sampling interval */
+    report_template_entry reportTemplate[MAX_REPORT_TEMPLATE_ENTRIES];
+    byte reportTemplateLength;
+    void setReportTemplate(byte argc, byte* argv);
+    void clearReportTemplate();
+    bool readReportSource(byte sourceType, byte index, int32_t* value) override;
+    void sendReportFrame();
 };
 
 #endif
@@ -19,6 +19,14 @@
 
 #include <ConfigurableFirmata.h>
 
+// Value sources that can be used in a report template (see FirmataExt)
+#define REPORT_SOURCE_ANALOG        0x00 // index: analog channel
+#define REPORT_SOURCE_DIGITAL_PORT  0x01 // index: port number
+#define REPORT_SOURCE_I2C_QUERY     0x02 // index: slot of a continuous I2C read
+#define REPORT_SOURCE_FREQUENCY     0x03 // index: pin of the frequency counter
+#define REPORT_SOURCE_STEPPER       0x04 // index: AccelStepper device number
+#define REPORT_SOURCE_ENCODER       0x05 // index: encoder number
+
 class FirmataFeature
 {
   public:
@@ -43,6 +51,22 @@ class FirmataFeature
         // Empty base implementation (standard messages handled in FirmataExt.cpp)
         return false;
     }
+
+    /// <summary>
+    /// Reads the current value of a report template source. Returns false if the source is not provided by this feature.
+    /// </summary>
+    virtual bool readReportSource(byte sourceType, byte index, int32_t* value)
+    {
+        return false;
+    }
+
+    /// <summary>
+    /// Called when the report template changes. Features that suppress their own messages for
+    /// sources in the template re-enable them here.
+    /// </summary>
+    virtual void reportTemplateChanged()
+    {
+    }
 };
 
 #endif
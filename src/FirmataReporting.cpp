@@ -21,6 +21,8 @@
 void FirmataReporting::setSamplingInterval(int interval)
 {
   samplingInterval = interval;
+  effectiveInterval = interval;
+  relaxPasses = 0;
 }
 
 void FirmataReporting::handleCapability(byte pin)
@@ -41,22 +43,108 @@ boolean FirmataReporting::handleSysex(byte command, byte argc, byte* argv)
       if (samplingInterval < MINIMUM_SAMPLING_INTERVAL) {
         samplingInterval = MINIMUM_SAMPLING_INTERVAL;
       }
+      setSamplingInterval(samplingInterval);
       return true;
     }
   }
+  if (command == TIME_SYNC && argc > 0) {
+    handleTimeSync(argc, argv);
+    return true;
+  }
   return false;
 }
 
+/*
+ * The host sends a ping with an arbitrary payload (e.g. its own send time) and gets it back together with the
+ * device time. Measuring the round trip time repeatedly allows it to estimate the clock offset and drift.
+ */
+void FirmataReporting::handleTimeSync(byte argc, byte* argv)
+{
+  if (argv[0] == TIME_SYNC_PING) {
+    // Get the time first, so that the reply time doesn't depend on the payload length
+    uint64_t now = Firmata.micros64();
+    Firmata.startSysex();
+    Firmata.write(TIME_SYNC);
+    Firmata.write(TIME_SYNC_PONG);
+    for (byte i = 1; i < argc; i++) {
+      Firmata.write(argv[i]);
+    }
+    Firmata.sendPackedUInt64(now);
+    Firmata.endSysex();
+  } else if (argv[0] == TIME_SYNC_ENABLE && argc >= 2) {
+    Firmata.enableTimestamps(argv[1] != 0);
+  }
+}
+
+/*
+ * The load of the link is judged by the time spent in the writes to the stream during the last interval (a blocking
+ * stream stalls when its buffers are full) and by writes the stream rejected (a non-blocking one drops data).
+ * Time spent elsewhere in the loop, e.g. reading slow sensors, doesn't count.
+ * If sending takes more than half of the interval, the interval is doubled. It is halved again, down to the
+ * configured value, after several intervals with less than a quarter of the configured interval spent sending.
+ */
+void FirmataReporting::adaptInterval(unsigned long sendDuration)
+{
+  bool congested = Firmata.takeSendFailures() > 0 || sendDuration / 500 > effectiveInterval;
+  if (congested) {
+    relaxPasses = 0;
+    unsigned long stretched = effectiveInterval * 2;
+    unsigned long maximum = (unsigned long)samplingInterval * ADAPTIVE_MAX_STRETCH;
+    effectiveInterval = stretched > maximum ? maximum : stretched;
+  } else if (effectiveInterval > samplingInterval && sendDuration / 250 < samplingInterval) {
+    if (++relaxPasses >= ADAPTIVE_RELAX_PASSES) {
+      relaxPasses = 0;
+      effectiveInterval = effectiveInterval / 2 < samplingInterval ? samplingInterval : effectiveInterval / 2;
+    }
+  } else {
+    relaxPasses = 0;
+  }
+}
+
 boolean FirmataReporting::elapsed()
 {
+  // Keep the 64 bit time up to date, even if nothing is reported for a long time
+  Firmata.micros64();
   currentMillis = millis();
-  if (currentMillis - previousMillis > samplingInterval) 
+  if (currentMillis - previousMillis > effectiveInterval)
   {
-    previousMillis += samplingInterval;
-    if (currentMillis - previousMillis > samplingInterval)
+    previousMillis += effectiveInterval;
+    if (currentMillis - previousMillis > effectiveInterval)
     {
-      previousMillis = currentMillis - samplingInterval;
+      previousMillis = currentMillis - effectiveInterval;
+    }
+    if (adaptive) {
+      adaptInterval(Firmata.takeSendTime());
+    }
+    return true;
+  }
+  return false;
+}
+
+bool FirmataReporting::handleSystemVariableQuery(bool write, SystemVariableDataType* data_type, int variable_id, byte pin, SystemVariableError* status, int* value)
+{
+  if (variable_id == REPORTING_VARIABLE_EFFECTIVE_INTERVAL) {
+    *data_type = SystemVariableDataType::Int;
+    if (write) {
+      *status = SystemVariableError::Readonly;
+      return true;
+    }
+    *value = effectiveInterval;
+    *status = SystemVariableError::NoError;
+    return true;
+  }
+  if (variable_id == REPORTING_VARIABLE_ADAPTIVE) {
+    *data_type = SystemVariableDataType::Int;
+    if (write) {
+      adaptive = *value != 0;
+      if (!adaptive) {
+        setSamplingInterval(samplingInterval);
+      }
+      Firmata.measureSendTime(adaptive);
+      Firmata.takeSendFailures();
     }
+    *value = adaptive ? 1 : 0;
+    *status = SystemVariableError::NoError;
     return true;
   }
   return false;
@@ -65,6 +153,9 @@ boolean FirmataReporting::elapsed()
 void FirmataReporting::reset()
 {
   previousMillis = millis();
-  samplingInterval = 19;
+  setSamplingInterval(19);
+  adaptive = false;
+  Firmata.measureSendTime(false);
+  Firmata.enableTimestamps(false);
 }
 
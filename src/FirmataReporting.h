@@ -24,6 +24,12 @@
 
 #define MINIMUM_SAMPLING_INTERVAL 1
 
+#define REPORTING_VARIABLE_EFFECTIVE_INTERVAL 106 // the sampling interval currently used, in ms (read only)
+#define REPORTING_VARIABLE_ADAPTIVE           107 // 1 = stretch the interval when the link can't keep up, 0 = off (default)
+
+#define ADAPTIVE_MAX_STRETCH        16 // the effective interval is at most this multiple of the configured one
+#define ADAPTIVE_RELAX_PASSES       8  // number of light report passes before the interval is shortened again
+
 class FirmataReporting: public FirmataFeature
 {
   public:
@@ -32,12 +38,17 @@ class FirmataReporting: public FirmataFeature
       currentMillis = 0;
       previousMillis = 0;
       samplingInterval = MINIMUM_SAMPLING_INTERVAL;
+      effectiveInterval = MINIMUM_SAMPLING_INTERVAL;
+      adaptive = false;
+      relaxPasses = 0;
     }
     void setSamplingInterval(int interval);
     void handleCapability(byte pin); //empty method
     boolean handlePinMode(byte pin, int mode); //empty method
     boolean handleSysex(byte command, byte argc, byte* argv);
     void reset();
+    void handleTimeSync(byte argc, byte* argv);
+    bool handleSystemVariableQuery(bool write, SystemVariableDataType* data_type, int variable_id, byte pin, SystemVariableError* status, int* value) override;
 
     boolean elapsed();
   private:
@@ -46,6 +57,12 @@ class FirmataReporting: public FirmataFeature
     unsigned long currentMillis;        // store the current value from millis()
     unsigned long previousMillis;       // for comparison with currentMillis
     unsigned int samplingInterval;          // how often to run the main loop (in ms)
+
+    /* adaptive reporting */
+    unsigned long effectiveInterval;    // samplingInterval, stretched if the link is too slow
+    bool adaptive;
+    byte relaxPasses;
+    void adaptInterval(unsigned long sendDuration);
 };
 
 #endif
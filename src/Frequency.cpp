@@ -19,23 +19,107 @@
 #include <ConfigurableFirmata.h>
 #include "Frequency.h"
 
+#ifndef ARDUINO_ISR_ATTR
+#define ARDUINO_ISR_ATTR
+#endif
+
 Frequency *FrequencyFirmataInstance;
 
-volatile int32_t Frequency::_ticks = 0;
+volatile int32_t Frequency::_ticks[FREQUENCY_MAX_COUNTERS];
+
+// attachInterrupt() doesn't pass an argument to the handler on all cores, therefore there's one handler per counter
+template<byte slot> void ARDUINO_ISR_ATTR Frequency::FrequencyIsr()
+{
+	// The ISR can't be interrupted by the main routine, therefore this is thread safe
+	_ticks[slot]++;
+}
+
+void (* const Frequency::isrTable[FREQUENCY_MAX_COUNTERS])() = {
+	FrequencyIsr<0>, FrequencyIsr<1>, FrequencyIsr<2>, FrequencyIsr<3>,
+#if FREQUENCY_MAX_COUNTERS > 4
+	FrequencyIsr<4>, FrequencyIsr<5>, FrequencyIsr<6>, FrequencyIsr<7>,
+#endif
+};
+
+byte Frequency::_periodPins[FREQUENCY_MAX_COUNTERS];
+frequency_period_state Frequency::_periods[FREQUENCY_MAX_COUNTERS];
+
+template<byte slot> void ARDUINO_ISR_ATTR Frequency::PeriodIsr()
+{
+	recordEdge(slot);
+}
+
+void (* const Frequency::periodIsrTable[FREQUENCY_MAX_COUNTERS])() = {
+	PeriodIsr<0>, PeriodIsr<1>, PeriodIsr<2>, PeriodIsr<3>,
+#if FREQUENCY_MAX_COUNTERS > 4
+	PeriodIsr<4>, PeriodIsr<5>, PeriodIsr<6>, PeriodIsr<7>,
+#endif
+};
+
+void ARDUINO_ISR_ATTR Frequency::recordEdge(byte slot)
+{
+	uint32_t now = micros();
+	byte level = digitalRead(_periodPins[slot]);
+	frequency_period_state& state = _periods[slot];
+	_ticks[slot]++;
+	if (state.valid)
+	{
+		// The phase that just ended has the opposite level
+		if (level == HIGH)
+		{
+			state.lowTime += now - state.lastEdge;
+			state.lowPhases++;
+		}
+		else
+		{
+			state.highTime += now - state.lastEdge;
+			state.highPhases++;
+		}
+	}
+	if (level == HIGH)
+	{
+		if (state.rises == 0)
+		{
+			state.firstRise = now;
+		}
+		state.lastRise = now;
+		state.rises++;
+	}
+	state.lastEdge = now;
+	state.lastLevel = level;
+	state.valid = true;
+	state.history[state.historyHead] = now;
+	state.historyHead = (state.historyHead + 1) % FREQUENCY_EDGE_HISTORY;
+	if (state.historyCount < FREQUENCY_EDGE_HISTORY)
+	{
+		state.historyCount++;
+	}
+}
 
 Frequency::Frequency()
 {
   FrequencyFirmataInstance = this;
-  _activePin = -1;
-  _reportDelay = 0;
-  _ticks = 0;
-  _lastReport = millis();
+  for (byte i = 0; i < FREQUENCY_MAX_COUNTERS; i++)
+  {
+	  _counters[i].pin = -1;
+	  _counters[i].mode = INTERRUPT_MODE_DISABLE;
+	  _counters[i].hardware = false;
+	  _counters[i].reportDelay = 0;
+	  _counters[i].lastReport = 0;
+	  _ticks[i] = 0;
+  }
 }
 
-void Frequency::FrequencyIsr()
+int Frequency::findCounter(int pin)
 {
-	// The ISR can't be interrupted by the main routine, therefore this is thread safe
-	_ticks++;
+	for (byte i = 0; i < FREQUENCY_MAX_COUNTERS; i++)
+	{
+		if (_counters[i].pin == pin)
+		{
+			return i;
+		}
+	}
+	return -1;
 }
 
 boolean Frequency::handleSysex(byte command, byte argc, byte* argv)
@@ -50,120 +134,380 @@ boolean Frequency::handleSysex(byte command, byte argc, byte* argv)
 	  byte pin = argv[1];
 	  if (frequencyCommand == FREQUENCY_SUBCOMMAND_CLEAR)
 	  {
-		  if (_activePin == pin || (_activePin >= 0 && pin == 0x7F))
+		  for (byte i = 0; i < FREQUENCY_MAX_COUNTERS; i++)
+		  {
+			  if (_counters[i].pin >= 0 && (_counters[i].pin == pin || pin == FREQUENCY_ALL_PINS))
+			  {
+				  stopCounter(i);
+			  }
+		  }
+	  }
+	  else if (frequencyCommand == FREQUENCY_SUBCOMMAND_EDGES)
+	  {
+		  int slot = findCounter(pin);
+		  if (slot < 0 || _counters[slot].mode != INTERRUPT_MODE_PERIOD)
 		  {
-		  	// This cannot be -1 here
-			  uint8_t interrupt = (uint8_t)digitalPinToInterrupt(_activePin);
-			  detachInterrupt(interrupt);
-			  _activePin = -1;
+			  Firmata.sendString(F("Pin is not in frequency period mode"), pin);
+			  return true;
 		  }
+		  reportEdges(slot);
 	  }
   }
   if (argc >= 5) // Expected: A command byte, a pin, the mode and a packed short
   {
 	  byte frequencyCommand = argv[0];
 	  byte pin = argv[1];
-	  int interrupt = digitalPinToInterrupt(pin);
 	  byte mode = argv[2]; // see below
 	  int32_t ms = (argv[4] << 7) | argv[3];
 	  // Set or query
 	  if (frequencyCommand == FREQUENCY_SUBCOMMAND_QUERY)
 	  {
-		  if (pin >= TOTAL_PINS || interrupt < 0)
+		  if (pin >= TOTAL_PINS || !canCount(pin))
 		  {
 			  Firmata.sendString(F("Invalid pin number for frequency command"));
 			  return true;
 		  }
-		  
-		  if (ms > 0)
+
+		  if (mode == INTERRUPT_MODE_PERIOD && digitalPinToInterrupt(pin) < 0)
 		  {
-			  _lastReport = millis();
-			  _reportDelay = ms;
+			  // Checked before anything is changed, so a counter running on this pin is kept
+			  Firmata.sendString(F("Period mode needs an interrupt capable pin"), pin);
+			  return true;
 		  }
-		  if (_activePin == -1)
+		  int slot = findCounter(pin);
+		  if (slot < 0 || _counters[slot].mode != mode)
 		  {
-			  // not yet enabled on this pin
-			  // Must use "auto" here, because the value uses an enum type on newer boards.
-			  auto internalMode = LOW;
-			  switch (mode)
-			  {
-				  case INTERRUPT_MODE_LOW:
-				  internalMode = LOW;
-				  break;
-				  case INTERRUPT_MODE_HIGH:
-				  internalMode = HIGH;
-				  break;
-				  case INTERRUPT_MODE_FALLING:
-				  internalMode = FALLING;
-				  break;
-				  case INTERRUPT_MODE_RISING:
-				  internalMode = RISING;
-				  break;
-				  case INTERRUPT_MODE_CHANGE:
-				  internalMode = CHANGE;
-				  break;
-			  }
-			  if (internalMode >= 0)
+			  // not yet enabled on this pin, or with a different edge mode
+			  if (!startCounter(pin, mode))
 			  {
-				  attachInterrupt(digitalPinToInterrupt(pin), FrequencyIsr, internalMode);
-				  _activePin = pin;
+				  Firmata.sendString(F("No free frequency counter"));
+				  return true;
 			  }
-			  
-			  pinMode(pin, INPUT);
-			  Firmata.setPinMode(pin, PIN_MODE_FREQUENCY);
-			  // Firmata.sendStringf(F("Frequency mode enabled with delay %ld on pin %ld"), (int32_t)_reportDelay, (int32_t)pin);
+			  slot = findCounter(pin);
 		  }
-		  else if (_activePin != pin)
+		  if (ms > 0)
 		  {
-			  Firmata.sendString(F("Cannot change pin number while active"));
-			  return true;
+			  _counters[slot].lastReport = millis();
+			  _counters[slot].reportDelay = (uint16_t)ms;
 		  }
-		  reportValue(pin);
+		  reportValue(slot);
 	  }
   }
   return true;
 }
 
+bool Frequency::canCount(byte pin)
+{
+	return IS_PIN_DIGITAL(pin) && (digitalPinToInterrupt(pin) >= 0 || isHardwareCounterPin(pin));
+}
+
+bool Frequency::startCounter(byte pin, byte mode)
+{
+	if (mode == INTERRUPT_MODE_PERIOD && digitalPinToInterrupt(pin) < 0)
+	{
+		return false;
+	}
+	int slot = findCounter(pin);
+	if (slot >= 0)
+	{
+		// Changing the mode of a running counter: keep the ticks counted so far
+		int32_t ticks = readTicks(slot);
+		stopCounter(slot);
+		_ticks[slot] = ticks;
+	}
+	else
+	{
+		slot = findCounter(-1);
+		if (slot < 0)
+		{
+			return false;
+		}
+		_counters[slot].reportDelay = 0;
+		_counters[slot].lastReport = millis();
+		noInterrupts();
+		_ticks[slot] = 0;
+		interrupts();
+	}
+
+	// Must use "auto" here, because the value uses an enum type on newer boards.
+	auto internalMode = LOW;
+	switch (mode)
+	{
+		case INTERRUPT_MODE_LOW:
+		internalMode = LOW;
+		break;
+		case INTERRUPT_MODE_HIGH:
+		internalMode = HIGH;
+		break;
+		case INTERRUPT_MODE_FALLING:
+		internalMode = FALLING;
+		break;
+		case INTERRUPT_MODE_RISING:
+		internalMode = RISING;
+		break;
+		case INTERRUPT_MODE_CHANGE:
+		internalMode = CHANGE;
+		break;
+	}
+	pinMode(pin, INPUT);
+	Firmata.setPinMode(pin, PIN_MODE_FREQUENCY);
+	if (mode == INTERRUPT_MODE_PERIOD)
+	{
+		noInterrupts();
+		memset(&_periods[slot], 0, sizeof(frequency_period_state));
+		_periodPins[slot] = pin;
+		interrupts();
+		attachInterrupt(digitalPinToInterrupt(pin), periodIsrTable[slot], CHANGE);
+		_counters[slot].hardware = false;
+		_counters[slot].pin = pin;
+		_counters[slot].mode = mode;
+		return true;
+	}
+	_counters[slot].hardware = startHardwareCounter(slot, pin, mode);
+	if (!_counters[slot].hardware)
+	{
+		if (digitalPinToInterrupt(pin) < 0)
+		{
+			// A pin that is only supported by the hardware counter, but the counter is in use or can't do this mode
+			return false;
+		}
+		attachInterrupt(digitalPinToInterrupt(pin), isrTable[slot], internalMode);
+	}
+	_counters[slot].pin = pin;
+	_counters[slot].mode = mode;
+	return true;
+}
+
+void Frequency::stopCounter(byte slot)
+{
+	if (_counters[slot].hardware)
+	{
+		stopHardwareCounter(slot);
+		_counters[slot].hardware = false;
+	}
+	else
+	{
+		// This cannot be -1 here
+		detachInterrupt(digitalPinToInterrupt(_counters[slot].pin));
+	}
+	_counters[slot].pin = -1;
+}
+
+int32_t Frequency::readTicks(byte slot)
+{
+	// Disable the interrupts, so that we can read out the counter
+	noInterrupts();
+	int32_t ticks = _ticks[slot];
+	interrupts();
+	if (_counters[slot].hardware)
+	{
+		ticks += readHardwareCounter(slot);
+	}
+	return ticks;
+}
+
+/*
+ * All counters are reported together when the report delay has elapsed: the edge counters in one message
+ * (if there is only one, the message has the same format as before there were several counters), followed
+ * by the period reports.
+ */
 void Frequency::report(bool elapsed)
 {
-	int mi = millis();
-	if (mi < _lastReport || mi > (_lastReport + _reportDelay))
+#ifdef FREQUENCY_HW_COUNTER_RP2040_PWM
+	// The PWM counters only have 16 bits, so they need to be read regularly
+	for (byte i = 0; i < FREQUENCY_MAX_COUNTERS; i++)
+	{
+		if (_counters[i].pin >= 0 && _counters[i].hardware)
+		{
+			readHardwareCounter(i);
+		}
+	}
+#endif
+	// Each counter has its own report delay. The edge counters that are due in the same pass are sent together.
+	uint32_t mi = millis();
+	byte edgeSlots[FREQUENCY_MAX_COUNTERS];
+	byte periodSlots[FREQUENCY_MAX_COUNTERS];
+	byte numEdge = 0;
+	byte numPeriod = 0;
+	for (byte i = 0; i < FREQUENCY_MAX_COUNTERS; i++)
 	{
-		if (_activePin >= 0)
+		frequency_counter& counter = _counters[i];
+		if (counter.pin < 0 || mi - counter.lastReport <= counter.reportDelay)
+		{
+			continue;
+		}
+		counter.lastReport = mi;
+		if (counter.mode == INTERRUPT_MODE_PERIOD)
+		{
+			periodSlots[numPeriod++] = i;
+		}
+		else
 		{
-			reportValue(_activePin);
+			edgeSlots[numEdge++] = i;
 		}
-		_lastReport = mi;
+	}
+	if (numEdge == 1)
+	{
+		reportValue(edgeSlots[0]);
+	}
+	else if (numEdge > 1)
+	{
+		Firmata.startSysex();
+		Firmata.write(FREQUENCY_COMMAND);
+		Firmata.write(FREQUENCY_SUBCOMMAND_REPORT_MULTIPLE);
+		Firmata.sendPackedUInt32(mi);
+		for (byte i = 0; i < numEdge; i++)
+		{
+			Firmata.write((byte)_counters[edgeSlots[i]].pin);
+			Firmata.sendPackedUInt32(readTicks(edgeSlots[i]));
+		}
+		Firmata.endSysex();
+	}
+	for (byte i = 0; i < numPeriod; i++)
+	{
+		reportPeriod(periodSlots[i]);
 	}
 }
 
-void Frequency::reportValue(int pin)
+/*
+ * Sends the averages over the edges since the last period report and starts a new window. The period is
+ * measured between rising edges, so a window continues at the last rising edge of the previous one.
+ * Format: pin, number of periods (14 bit), average period, high time and low time in us (packed uint32s),
+ * duty cycle in 1/10000 (14 bit). Values that couldn't be measured in this window are 0.
+ */
+void Frequency::reportPeriod(byte slot)
 {
-	int32_t currentTime = millis();
-	// Clear the interrupt flag, so that we can read out the counter
+	frequency_period_state& state = _periods[slot];
 	noInterrupts();
-	int32_t ticks = _ticks;
+	uint16_t rises = state.rises;
+	uint32_t riseSpan = state.lastRise - state.firstRise;
+	uint32_t highTime = state.highTime;
+	uint32_t lowTime = state.lowTime;
+	uint16_t highPhases = state.highPhases;
+	uint16_t lowPhases = state.lowPhases;
+	if (rises > 0)
+	{
+		state.firstRise = state.lastRise;
+		state.rises = 1;
+	}
+	state.highTime = 0;
+	state.lowTime = 0;
+	state.highPhases = 0;
+	state.lowPhases = 0;
 	interrupts();
+
+	uint16_t periods = rises > 1 ? rises - 1 : 0;
+	uint16_t duty = 0;
+	if (highTime + lowTime > 0)
+	{
+		duty = (uint16_t)(((uint64_t)highTime * 10000) / ((uint64_t)highTime + lowTime));
+	}
+	Firmata.sendTimestamp();
+	Firmata.startSysex();
+	Firmata.write(FREQUENCY_COMMAND);
+	Firmata.write(FREQUENCY_SUBCOMMAND_PERIOD_REPORT);
+	Firmata.write((byte)_counters[slot].pin);
+	Firmata.sendPackedUInt14(periods);
+	Firmata.sendPackedUInt32(periods > 0 ? riseSpan / periods : 0);
+	Firmata.sendPackedUInt32(highPhases > 0 ? highTime / highPhases : 0);
+	Firmata.sendPackedUInt32(lowPhases > 0 ? lowTime / lowPhases : 0);
+	Firmata.sendPackedUInt14(duty);
+	Firmata.endSysex();
+}
+
+/*
+ * Format: pin, level after the newest edge, number of edges, format, micros() of the oldest edge (packed uint32),
+ * then the time of each further edge relative to the oldest one, either as 3 x 7 bits or as packed uint32s.
+ */
+void Frequency::reportEdges(byte slot)
+{
+	frequency_period_state& state = _periods[slot];
+	uint32_t edges[FREQUENCY_EDGE_HISTORY];
+	noInterrupts();
+	byte count = state.historyCount;
+	byte level = state.lastLevel;
+	byte index = (state.historyHead + FREQUENCY_EDGE_HISTORY - count) % FREQUENCY_EDGE_HISTORY;
+	for (byte i = 0; i < count; i++)
+	{
+		edges[i] = state.history[index];
+		index = (index + 1) % FREQUENCY_EDGE_HISTORY;
+	}
+	interrupts();
+
+	byte format = FREQUENCY_EDGES_FORMAT_21BIT;
+	if (count > 0 && edges[count - 1] - edges[0] >= (1UL << 21))
+	{
+		format = FREQUENCY_EDGES_FORMAT_32BIT;
+	}
+	Firmata.startSysex();
+	Firmata.write(FREQUENCY_COMMAND);
+	Firmata.write(FREQUENCY_SUBCOMMAND_EDGES);
+	Firmata.write((byte)_counters[slot].pin);
+	Firmata.write(level);
+	Firmata.write(count);
+	Firmata.write(format);
+	if (count > 0)
+	{
+		Firmata.sendPackedUInt32(edges[0]);
+	}
+	for (byte i = 1; i < count; i++)
+	{
+		uint32_t delta = edges[i] - edges[0];
+		if (format == FREQUENCY_EDGES_FORMAT_21BIT)
+		{
+			Firmata.write((byte)(delta & 0x7F));
+			Firmata.write((byte)((delta >> 7) & 0x7F));
+			Firmata.write((byte)((delta >> 14) & 0x7F));
+		}
+		else
+		{
+			Firmata.sendPackedUInt32(delta);
+		}
+	}
+	Firmata.endSysex();
+}
+
+void Frequency::reportValue(byte slot)
+{
+	if (_counters[slot].mode == INTERRUPT_MODE_PERIOD)
+	{
+		reportPeriod(slot);
+		return;
+	}
+	int32_t currentTime = millis();
+	int32_t ticks = readTicks(slot);
 	Firmata.startSysex();
 	Firmata.write(FREQUENCY_COMMAND);
 	Firmata.write(FREQUENCY_SUBCOMMAND_REPORT);
-	Firmata.write(pin);
+	Firmata.write((byte)_counters[slot].pin);
 	Firmata.sendPackedUInt32(currentTime);
 	Firmata.sendPackedUInt32(ticks);
 	Firmata.endSysex();
 }
 
+// A report template gets the raw tick count, the host knows the interval from the frame timestamps
+bool Frequency::readReportSource(byte sourceType, byte index, int32_t* value)
+{
+	int slot = findCounter(index);
+	if (sourceType != REPORT_SOURCE_FREQUENCY || slot < 0)
+	{
+		return false;
+	}
+	*value = readTicks(slot);
+	return true;
+}
+
 boolean Frequency::handlePinMode(byte pin, int mode)
 {
-  int interruptPin = digitalPinToInterrupt(pin);
-  if (IS_PIN_DIGITAL(pin) && interruptPin >= 0) 
+  if (canCount(pin))
   {
     if (mode == PIN_MODE_FREQUENCY) {
       return true;
-    } else if (pin == _activePin)
+    }
+    int slot = findCounter(pin);
+    if (slot >= 0)
 	{
-      detachInterrupt(interruptPin);
-	  _activePin = -1;
+      stopCounter(slot);
     }
   }
   return false;
@@ -171,8 +515,7 @@ boolean Frequency::handlePinMode(byte pin, int mode)
 
 void Frequency::handleCapability(byte pin)
 {
-  int interrupt = digitalPinToInterrupt(pin);
-  if (IS_PIN_DIGITAL(pin) && interrupt >= 0) {
+  if (canCount(pin)) {
     Firmata.write((byte)PIN_MODE_FREQUENCY);
     Firmata.write((byte)0); // 4 byte clock, 4 byte timestamp
   }
@@ -180,9 +523,11 @@ void Frequency::handleCapability(byte pin)
 
 void Frequency::reset()
 {
-	if (_activePin >= 0)
+	for (byte i = 0; i < FREQUENCY_MAX_COUNTERS; i++)
 	{
-		detachInterrupt(digitalPinToInterrupt(_activePin));
-		_activePin = -1;
+		if (_counters[i].pin >= 0)
+		{
+			stopCounter(i);
+		}
 	}
 }
@@ -26,13 +26,77 @@
 #define INTERRUPT_MODE_RISING 3
 #define INTERRUPT_MODE_FALLING 4
 #define INTERRUPT_MODE_CHANGE 5
+#define INTERRUPT_MODE_PERIOD 6 // timestamp both edges, report period and pulse widths instead of ticks
 
 #define FREQUENCY_SUBCOMMAND_CLEAR 0
 #define FREQUENCY_SUBCOMMAND_QUERY 1
 #define FREQUENCY_SUBCOMMAND_REPORT 2
+#define FREQUENCY_SUBCOMMAND_REPORT_MULTIPLE 3 // reply: the values of all counters whose report delay expired in the same pass
+#define FREQUENCY_SUBCOMMAND_PERIOD_REPORT 4 // reply: period, high and low time and duty cycle of a counter in period mode
+#define FREQUENCY_SUBCOMMAND_EDGES 5 // request/reply: the timestamps of the last edges of a counter in period mode
 
-// This class tries to accurately measure the number of ticks per time on a specific pin.
-// All pins that have interrupt capability can be used, but only one at a time. 
+#define FREQUENCY_EDGES_FORMAT_21BIT 0 // the deltas to the oldest edge use 3 bytes each
+#define FREQUENCY_EDGES_FORMAT_32BIT 1 // the deltas to the oldest edge are packed uint32s
+
+#define FREQUENCY_ALL_PINS 0x7F
+
+// Hardware counter backends. Edge modes on supported pins use these, other modes and pins use an interrupt per edge.
+#if defined(ESP32) && defined(__has_include)
+#if __has_include(<driver/pulse_cnt.h>)
+#include <driver/pulse_cnt.h>
+#include <soc/soc_caps.h>
+#if SOC_PCNT_SUPPORTED
+#define FREQUENCY_HW_COUNTER_PCNT 1 // a PCNT unit per counter, any pin
+#endif
+#endif
+#elif (defined(TARGET_RP2040) || defined(TARGET_RASPBERRY_PI_PICO)) && !defined(ARDUINO_ARCH_MBED) && \
+      !defined(ARDUINO_NANO_RP2040_CONNECT) && defined(__has_include)
+// The pin is used as GPIO number, that's not the case on the mbed core (same restriction as RP2040_PINOUT_OPTIMIZE)
+#if __has_include(<hardware/pwm.h>)
+#define FREQUENCY_HW_COUNTER_RP2040_PWM 1 // the counter of a PWM slice, odd pins (channel B) only
+#endif
+#elif (defined(__AVR_ATmega328P__) || defined(__AVR_ATmega168__)) && defined(FREQUENCY_USE_TIMER1)
+// Opt-in with the build flag -DFREQUENCY_USE_TIMER1 (a define in the sketch doesn't reach the library). The Timer1
+// overflow vector can only be defined once, so it would otherwise conflict with other libraries using Timer1.
+#define FREQUENCY_HW_COUNTER_AVR_TIMER1 1 // Timer1 clocked from T1, pin 5 only
+#define FREQUENCY_TIMER1_PIN 5
+#endif
+
+#ifdef LARGE_MEM_DEVICE
+#define FREQUENCY_MAX_COUNTERS 8
+#define FREQUENCY_EDGE_HISTORY 16
+#else
+#define FREQUENCY_MAX_COUNTERS 4
+#define FREQUENCY_EDGE_HISTORY 4
+#endif
+
+// Edge timing of a counter in period mode. Written by the ISR, read with interrupts disabled.
+struct frequency_period_state {
+	uint32_t lastEdge;  // micros() of the last edge
+	uint32_t firstRise; // first rising edge of the current window
+	uint32_t lastRise;
+	uint16_t rises;     // rising edges in the current window
+	uint32_t highTime;  // sum of completed high phases in the current window, in us
+	uint32_t lowTime;
+	uint16_t highPhases;
+	uint16_t lowPhases;
+	bool valid;         // lastEdge is set
+	byte lastLevel;
+	uint32_t history[FREQUENCY_EDGE_HISTORY];
+	byte historyHead;   // index of the next entry
+	byte historyCount;
+};
+
+struct frequency_counter {
+	int pin; // -1 if the slot is free
+	byte mode;
+	bool hardware; // counted by a hardware counter instead of the ISR
+	uint16_t reportDelay; // in ms, set by the query of this pin
+	uint32_t lastReport; // millis() of the last report
+};
+
+// This class tries to accurately measure the number of ticks per time on specific pins.
+// All pins that have interrupt capability can be used, up to FREQUENCY_MAX_COUNTERS at a time.
 class Frequency: public FirmataFeature
 {
   public:
@@ -42,13 +106,40 @@ class Frequency: public FirmataFeature
     boolean handleSysex(byte command, byte argc, byte* argv);
     boolean handlePinMode(byte pin, int mode);
     void reset();
+    bool readReportSource(byte sourceType, byte index, int32_t* value) override;
   private:
-    static void FrequencyIsr();
-    void reportValue(int pin);
-    int _activePin;
-	int32_t _reportDelay;
-	int32_t _lastReport;
-	static volatile int32_t _ticks;
+    template<byte slot> static void FrequencyIsr();
+    static void (* const isrTable[FREQUENCY_MAX_COUNTERS])();
+    template<byte slot> static void PeriodIsr();
+    static void (* const periodIsrTable[FREQUENCY_MAX_COUNTERS])();
+    static void recordEdge(byte slot);
+    void reportPeriod(byte slot);
+    void reportEdges(byte slot);
+    int findCounter(int pin);
+    bool startCounter(byte pin, byte mode);
+    void stopCounter(byte slot);
+    int32_t readTicks(byte slot);
+    void reportValue(byte slot);
+    static bool canCount(byte pin);
+
+    /* hardware counters, see FrequencyHardware.cpp */
+    static bool isHardwareCounterPin(byte pin);
+    bool startHardwareCounter(byte slot, byte pin, byte mode);
+    void stopHardwareCounter(byte slot);
+    int32_t readHardwareCounter(byte slot);
+#ifdef FREQUENCY_HW_COUNTER_PCNT
+    pcnt_unit_handle_t _pcntUnits[FREQUENCY_MAX_COUNTERS];
+    pcnt_channel_handle_t _pcntChannels[FREQUENCY_MAX_COUNTERS];
+#endif
+#ifdef FREQUENCY_HW_COUNTER_RP2040_PWM
+    uint16_t _pwmLastCount[FREQUENCY_MAX_COUNTERS];
+    int32_t _pwmTotal[FREQUENCY_MAX_COUNTERS];
+#endif
+
+    frequency_counter _counters[FREQUENCY_MAX_COUNTERS];
+	static volatile int32_t _ticks[FREQUENCY_MAX_COUNTERS]; // ISR counts, or the count before the hardware counter was (re)started
+	static byte _periodPins[FREQUENCY_MAX_COUNTERS];
+	static frequency_period_state _periods[FREQUENCY_MAX_COUNTERS];
 };
 
 #endif
@@ -0,0 +1,233 @@
+/*
+  FrequencyHardware.cpp - Firmata library
+  Hardware pulse counter backends of the Frequency feature. These count edges without
+  an interrupt per edge, so high input frequencies don't load the CPU.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <ConfigurableFirmata.h>
+#include "Frequency.h"
+
+#if defined(FREQUENCY_HW_COUNTER_PCNT)
+
+bool Frequency::isHardwareCounterPin(byte pin)
+{
+	// All pins that can be used with the ISR can also be used with a PCNT unit
+	return false;
+}
+
+bool Frequency::startHardwareCounter(byte slot, byte pin, byte mode)
+{
+	pcnt_channel_edge_action_t rising = PCNT_CHANNEL_EDGE_ACTION_HOLD;
+	pcnt_channel_edge_action_t falling = PCNT_CHANNEL_EDGE_ACTION_HOLD;
+	if (mode == INTERRUPT_MODE_RISING || mode == INTERRUPT_MODE_CHANGE)
+	{
+		rising = PCNT_CHANNEL_EDGE_ACTION_INCREASE;
+	}
+	if (mode == INTERRUPT_MODE_FALLING || mode == INTERRUPT_MODE_CHANGE)
+	{
+		falling = PCNT_CHANNEL_EDGE_ACTION_INCREASE;
+	}
+	if (rising == PCNT_CHANNEL_EDGE_ACTION_HOLD && falling == PCNT_CHANNEL_EDGE_ACTION_HOLD)
+	{
+		// Level modes
+		return false;
+	}
+
+	// The counter register has 16 bits. With accum_count, the driver extends it in software
+	// when the high limit watch point is reached, that is once every 32767 edges.
+	pcnt_unit_config_t unitConfig = {};
+	unitConfig.low_limit = -1;
+	unitConfig.high_limit = INT16_MAX;
+	unitConfig.flags.accum_count = 1;
+	if (pcnt_new_unit(&unitConfig, &_pcntUnits[slot]) != ESP_OK)
+	{
+		// All units in use
+		return false;
+	}
+	pcnt_chan_config_t channelConfig = {};
+	channelConfig.edge_gpio_num = pin;
+	channelConfig.level_gpio_num = -1;
+	if (pcnt_new_channel(_pcntUnits[slot], &channelConfig, &_pcntChannels[slot]) != ESP_OK)
+	{
+		pcnt_del_unit(_pcntUnits[slot]);
+		return false;
+	}
+	pcnt_channel_set_edge_action(_pcntChannels[slot], rising, falling);
+	pcnt_unit_add_watch_point(_pcntUnits[slot], INT16_MAX);
+	pcnt_unit_enable(_pcntUnits[slot]);
+	pcnt_unit_clear_count(_pcntUnits[slot]);
+	pcnt_unit_start(_pcntUnits[slot]);
+	return true;
+}
+
+void Frequency::stopHardwareCounter(byte slot)
+{
+	pcnt_unit_stop(_pcntUnits[slot]);
+	pcnt_unit_disable(_pcntUnits[slot]);
+	pcnt_unit_remove_watch_point(_pcntUnits[slot], INT16_MAX);
+	pcnt_del_channel(_pcntChannels[slot]);
+	pcnt_del_unit(_pcntUnits[slot]);
+}
+
+int32_t Frequency::readHardwareCounter(byte slot)
+{
+	int count = 0;
+	pcnt_unit_get_count(_pcntUnits[slot], &count);
+	return count;
+}
+
+#elif defined(FREQUENCY_HW_COUNTER_RP2040_PWM)
+
+#include <hardware/pwm.h>
+#include <hardware/gpio.h>
+
+bool Frequency::isHardwareCounterPin(byte pin)
+{
+	// All GPIOs have interrupts, so the ISR can always be used as fallback
+	return false;
+}
+
+bool Frequency::startHardwareCounter(byte slot, byte pin, byte mode)
+{
+	// Only the B input of a PWM slice can clock the counter, and the slice can't output PWM on its A pin at the same time
+	if ((pin & 1) == 0 || Firmata.getPinMode(pin - 1) == PIN_MODE_PWM)
+	{
+		return false;
+	}
+	if (mode != INTERRUPT_MODE_RISING && mode != INTERRUPT_MODE_FALLING)
+	{
+		return false;
+	}
+	uint sliceNum = pwm_gpio_to_slice_num(pin);
+	pwm_config config = pwm_get_default_config();
+	pwm_config_set_clkdiv_mode(&config, mode == INTERRUPT_MODE_RISING ? PWM_DIV_B_RISING : PWM_DIV_B_FALLING);
+	pwm_config_set_clkdiv(&config, 1.f);
+	pwm_init(sliceNum, &config, false);
+	gpio_set_function(pin, GPIO_FUNC_PWM);
+	pwm_set_counter(sliceNum, 0);
+	_pwmLastCount[slot] = 0;
+	_pwmTotal[slot] = 0;
+	pwm_set_enabled(sliceNum, true);
+	return true;
+}
+
+void Frequency::stopHardwareCounter(byte slot)
+{
+	byte pin = (byte)_counters[slot].pin;
+	pwm_set_enabled(pwm_gpio_to_slice_num(pin), false);
+	gpio_set_function(pin, GPIO_FUNC_SIO);
+}
+
+int32_t Frequency::readHardwareCounter(byte slot)
+{
+	// The counter wraps at 16 bits, so this needs to be called at least once per 65536 edges
+	uint16_t count = pwm_get_counter(pwm_gpio_to_slice_num((byte)_counters[slot].pin));
+	_pwmTotal[slot] += (uint16_t)(count - _pwmLastCount[slot]);
+	_pwmLastCount[slot] = count;
+	return _pwmTotal[slot];
+}
+
+#elif defined(FREQUENCY_HW_COUNTER_AVR_TIMER1)
+
+static volatile uint16_t timer1Overflows = 0;
+
+ISR(TIMER1_OVF_vect)
+{
+	timer1Overflows++;
+}
+
+bool Frequency::isHardwareCounterPin(byte pin)
+{
+	return pin == FREQUENCY_TIMER1_PIN;
+}
+
+/*
+ * Timer1 is shared with the Servo library and the PWM outputs on pins 9 and 10, so it's only used
+ * while none of these are active. They can be used again after the counter is stopped.
+ */
+bool Frequency::startHardwareCounter(byte slot, byte pin, byte mode)
+{
+	if (pin != FREQUENCY_TIMER1_PIN || (mode != INTERRUPT_MODE_RISING && mode != INTERRUPT_MODE_FALLING))
+	{
+		return false;
+	}
+	for (byte i = 0; i < TOTAL_PINS; i++)
+	{
+		if (Firmata.getPinMode(i) == PIN_MODE_SERVO || ((i == 9 || i == 10) && Firmata.getPinMode(i) == PIN_MODE_PWM))
+		{
+			return false;
+		}
+	}
+	for (byte i = 0; i < FREQUENCY_MAX_COUNTERS; i++)
+	{
+		if (_counters[i].pin >= 0 && _counters[i].hardware && i != slot)
+		{
+			return false;
+		}
+	}
+	noInterrupts();
+	TCCR1B = 0;
+	TCCR1A = 0;
+	TCNT1 = 0;
+	timer1Overflows = 0;
+	TIFR1 = _BV(TOV1);
+	TIMSK1 = _BV(TOIE1);
+	// External clock source on T1
+	TCCR1B = _BV(CS12) | _BV(CS11) | (mode == INTERRUPT_MODE_RISING ? _BV(CS10) : 0);
+	interrupts();
+	return true;
+}
+
+void Frequency::stopHardwareCounter(byte slot)
+{
+	noInterrupts();
+	TIMSK1 = 0;
+	// Restore the configuration of the Arduino core (8 bit phase correct PWM, prescaler 64)
+	TCCR1B = _BV(CS11) | _BV(CS10);
+	TCCR1A = _BV(WGM10);
+	interrupts();
+}
+
+int32_t Frequency::readHardwareCounter(byte slot)
+{
+	noInterrupts();
+	uint16_t low = TCNT1;
+	uint16_t high = timer1Overflows;
+	// An overflow that happened just now hasn't been handled by the ISR yet
+	if ((TIFR1 & _BV(TOV1)) && low < 0x8000)
+	{
+		high++;
+	}
+	interrupts();
+	return (int32_t)(((uint32_t)high << 16) | low);
+}
+
+#else
+
+bool Frequency::isHardwareCounterPin(byte pin)
+{
+	return false;
+}
+
+bool Frequency::startHardwareCounter(byte slot, byte pin, byte mode)
+{
+	return false;
+}
+
+void Frequency::stopHardwareCounter(byte slot)
+{
+}
+
+int32_t Frequency::readHardwareCounter(byte slot)
+{
+	return 0;
+}
+
+#endif
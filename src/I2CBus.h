@@ -0,0 +1,44 @@
+/*
+  I2CBus.h - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef I2CBus_h
+#define I2CBus_h
+
+#include <ConfigurableFirmata.h>
+
+/*
+ * The bus transfers used by I2CFirmata. Each call performs one complete transfer. A fake implementation
+ * can be passed to I2CFirmata::setBus() to run the job queue without hardware.
+ */
+class I2CBus
+{
+  public:
+    virtual void begin() = 0;
+    /// Writes the data and returns true if the device acknowledged all bytes
+    virtual bool write(byte address, const byte* data, byte length, bool stop) = 0;
+    /// Reads up to length bytes and returns the number of bytes the device sent. If this is more than length,
+    /// the surplus was discarded.
+    virtual int read(byte address, byte* buffer, byte length) = 0;
+    virtual ~I2CBus() = default;
+};
+
+/*
+ * I2CBus using the Wire library. Implemented in I2CFirmata.cpp, so that sketches don't need to include Wire.h.
+ */
+class WireBus: public I2CBus
+{
+  public:
+    void begin() override;
+    bool write(byte address, const byte* data, byte length, bool stop) override;
+    int read(byte address, byte* buffer, byte length) override;
+};
+
+#endif
@@ -8,60 +8,512 @@
 #include "Wire.h"
 #include "I2CFirmata.h"
 
+WireBus defaultWireBus;
+
+void WireBus::begin()
+{
+  Wire.end();
+#ifdef ARDUINO_M5STACK_Core2
+    // For the M5Stack, we explicitly choose the pins, because we want to use the internal I2C bus by default
+    // It has the on-board devices attached: touchscreen, RTC, power controller and IMU (Core2 only)
+  Wire.begin(21, 22);
+#else
+  Wire.begin();
+#endif
+}
+
+bool WireBus::write(byte address, const byte* data, byte length, bool stop)
+{
+  Wire.beginTransmission(address);
+  for (byte i = 0; i < length; i++) {
+    Wire.write(data[i]);
+  }
+  return Wire.endTransmission(stop) == 0;
+}
+
+int WireBus::read(byte address, byte* buffer, byte length)
+{
+  Wire.requestFrom(address, length);  // all bytes are returned in requestFrom
+
+  int available = Wire.available();
+  byte received = 0;
+  while (received < length && Wire.available()) {
+    buffer[received++] = Wire.read();
+  }
+  while (Wire.available()) {
+    Wire.read();
+  }
+  return available > received ? available : received;
+}
+
 I2CFirmata::I2CFirmata()
 {
     isI2CEnabled = false;
-    queryIndex = -1;
+    queryCount = 0;
+    templateInvalid = false;
     i2cReadDelayTime = 0;  // default delay time between i2c read request and Wire.requestFrom()
-    memset(i2cRxData, 0, 32);
+    memset(i2cRxData, 0, sizeof(i2cRxData));
+    configOptions = 0;
+    bus = &defaultWireBus;
+    jobHead = 0;
+    jobCount = 0;
+    jobState = JobState::Idle;
+    busyUntil = 0;
+    busy = false;
+    queryActive = false;
+    nextQuery = 0;
+    queryTurn = false;
+    writeHead = 0;
+    writeUsed = 0;
+    scriptLength = 0;
+    scriptQueued = false;
 }
 
-void I2CFirmata::readAndReportData(byte address, int theRegister, byte numBytes, byte stopTX, byte seqenceNo) {
-  // allow I2C requests that don't require a register read
-  // for example, some devices using an interrupt pin to signify new data available
-  // do not always require the register read so upon interrupt you call Wire.requestFrom()
-  if (theRegister != I2C_REGISTER_NOT_SPECIFIED) {
-    Wire.beginTransmission(address);
-    Wire.write((byte)theRegister);
-    Wire.endTransmission(stopTX); // default = true
-    // do not set a value of 0
-    if (i2cReadDelayTime > 0) {
-      // delay is necessary for some devices such as WiiNunchuck
-      delayMicroseconds(i2cReadDelayTime);
-    }
+void I2CFirmata::setBus(I2CBus& newBus)
+{
+  clearJobs();
+  bus = &newBus;
+}
+
+i2c_job* I2CFirmata::enqueueJob()
+{
+  if (jobCount >= I2C_JOB_QUEUE_SIZE) {
+    Firmata.sendString(F("I2C: Job queue full"));
+    return nullptr;
   }
-  else {
-    theRegister = 0;  // fill the register with a dummy value
+  i2c_job* job = &jobs[(jobHead + jobCount) % I2C_JOB_QUEUE_SIZE];
+  jobCount++;
+  job->queryIndex = -1;
+  job->offset = 0;
+  return job;
+}
+
+void I2CFirmata::finishJob()
+{
+  if (queryActive) {
+    queryActive = false;
+  } else {
+    jobHead = (jobHead + 1) % I2C_JOB_QUEUE_SIZE;
+    jobCount--;
   }
+  jobState = JobState::Idle;
+}
 
-  Wire.requestFrom(address, numBytes);  // all bytes are returned in requestFrom
+void I2CFirmata::clearJobs()
+{
+  jobHead = 0;
+  jobCount = 0;
+  jobState = JobState::Idle;
+  busy = false;
+  queryActive = false;
+  writeHead = 0;
+  writeUsed = 0;
+  scriptQueued = false;
+  for (byte i = 0; i < I2C_MAX_QUERIES; i++) {
+    query[i].pending = false;
+  }
+}
 
+/*
+ * Removes a continuous query by moving the last one into its place. If either of them is part of the report template,
+ * the template would read the wrong device, so all queries are reported as invalid sources until the template is set
+ * again. FirmataExt then clears the template and tells the host.
+ */
+void I2CFirmata::removeQuery(byte index)
+{
+  byte last = queryCount - 1;
+  if (query[index].inTemplate || (index != last && query[last].inTemplate)) {
+    templateInvalid = true;
+  }
+  if (queryActive && queryJob.queryIndex == index) {
+    // cancel the running read
+    queryJob.type = I2C_JOB_NONE;
+    queryJob.queryIndex = -1;
+  } else if (queryActive && queryJob.queryIndex == last) {
+    queryJob.queryIndex = index;
+  }
+  if (index != last) {
+    query[index] = query[last];
+  }
+  queryCount--;
+}
+
+/*
+ * Returns true if no job is queued or running and the settle time of the last transfer has passed.
+ */
+bool I2CFirmata::isBusIdle()
+{
+  return jobCount == 0 && !queryActive && jobState == JobState::Idle && (!busy || (int32_t)(micros() - busyUntil) >= 0);
+}
+
+void I2CFirmata::writeToBus(byte address, const byte* data, byte length, bool stop)
+{
+  bus->write(address, data, length, stop);
+  busyUntil = micros() + I2C_WRITE_SETTLE_TIME;
+  busy = true;
+}
+
+byte I2CFirmata::readFromBus(byte address, byte* buffer, byte length)
+{
+  int received = bus->read(address, buffer, length);
   // check to be sure correct number of bytes were returned by slave
-  if (numBytes < Wire.available()) {
+  if (received > length) {
     Firmata.sendString(F("I2C: Too many bytes received"));
+    return length;
   }
-  else if (numBytes > Wire.available()) {
-    // Firmata.sendString(F("I2C: Too few bytes received"));
-    numBytes = Wire.available();
+  return (byte)received;
+}
+
+/*
+ * Starts the read of the next continuous query that is due, searching round-robin so that all get their turn.
+ */
+bool I2CFirmata::startQuery()
+{
+  for (byte k = 0; k < queryCount; k++) {
+    byte i = (nextQuery + k) % queryCount;
+    i2c_device_info& device = query[i];
+    if (!device.pending) {
+      continue;
+    }
+    queryJob.type = I2C_JOB_READ;
+    queryJob.address = device.addr;
+    queryJob.reg = device.reg;
+    queryJob.length = device.bytes;
+    queryJob.offset = 0;
+    queryJob.stopTX = device.stopTX;
+    queryJob.sequenceNo = 0;
+    queryJob.queryIndex = i;
+    queryActive = true;
+    nextQuery = i + 1;
+    return true;
   }
+  return false;
+}
 
-  i2cRxData[0] = (byte)theRegister;
+/*
+ * Executes at most one bus transfer of the running continuous query or of the job at the head of the queue.
+ * A read with a register is split in two transfers, with the read delay in between.
+ */
+void I2CFirmata::processJobs()
+{
+  if (busy && (int32_t)(micros() - busyUntil) < 0) {
+    return;
+  }
+  busy = false;
+  if (!queryActive && jobState == JobState::Idle) {
+    // Between two jobs: take turns between the queue and the continuous queries, so neither starves the other
+    bool started = (jobCount == 0 || queryTurn) && startQuery();
+    queryTurn = !started;
+  }
+  if (!queryActive && jobCount == 0) {
+    return;
+  }
+  i2c_job& job = queryActive ? queryJob : jobs[jobHead];
+  switch (job.type) {
+    case I2C_JOB_NONE:
+      finishJob();
+      break;
+    case I2C_JOB_WRITE:
+      // The queued writes are executed in order, so the data of this one is at the start of the buffer
+      writeToBus(job.address, writeBuffer + writeHead, job.length, job.stopTX == I2C_STOP_TX);
+      writeHead += job.length;
+      writeUsed -= job.length;
+      if (writeUsed == 0) {
+        writeHead = 0;
+      }
+      finishJob();
+      break;
+    case I2C_JOB_READ:
+      if (jobState == JobState::Idle && job.reg != I2C_REGISTER_NOT_SPECIFIED) {
+        byte reg = (byte)job.reg;
+        bus->write(job.address, &reg, 1, job.stopTX == I2C_STOP_TX);
+        jobState = JobState::WaitForRead;
+        // do not set a value of 0
+        if (i2cReadDelayTime > 0) {
+          // delay is necessary for some devices such as WiiNunchuck
+          busyUntil = micros() + i2cReadDelayTime;
+          busy = true;
+        }
+        break;
+      }
+      // allow I2C requests that don't require a register read
+      // for example, some devices using an interrupt pin to signify new data available
+      // do not always require the register read so upon interrupt you call Wire.requestFrom()
+      i2cRxData[0] = job.reg == I2C_REGISTER_NOT_SPECIFIED ? 0 : (byte)job.reg;
+      if (job.length <= I2C_READ_CHUNK_SIZE) {
+        completeRead(job, readFromBus(job.address, i2cRxData + 1, job.length));
+        finishJob();
+        break;
+      }
+      {
+        // The register is only written before the first chunk, the following chunks continue from where
+        // the device stopped (this works for FIFOs and for auto-incrementing registers or EEPROMs)
+        byte chunk = job.length - job.offset < I2C_READ_CHUNK_SIZE ? job.length - job.offset : I2C_READ_CHUNK_SIZE;
+        byte numBytes = readFromBus(job.address, i2cRxData + 1, chunk);
+        bool last = numBytes < chunk || job.offset + chunk >= job.length;
+        sendReply(job, numBytes, last);
+        if (last) {
+          finishJob();
+        } else {
+          job.offset += chunk;
+          jobState = JobState::ReadingChunks;
+        }
+      }
+      break;
+    case I2C_JOB_SCRIPT:
+      runScript(job);
+      finishJob();
+      break;
+  }
+}
+
+/*
+ * Format: script id, operations. The script is checked and decoded here and executed when its job is processed.
+ * Only one script can be queued at a time.
+ */
+void I2CFirmata::handleI2CScript(byte argc, byte* argv)
+{
+  if (argc < 1) {
+    return;
+  }
+  if (scriptQueued) {
+    Firmata.sendString(F("I2C: Script already queued"));
+    return;
+  }
+  byte length = 0;
+  int readLength = 0;
+  bool hasAddress = false;
+  byte i = 1;
+  while (i < argc) {
+    byte op = argv[i++];
+    byte needed = 0;
+    switch (op) {
+      case I2C_SCRIPT_ADDRESS:
+        needed = 1;
+        break;
+      case I2C_SCRIPT_WRITE:
+        needed = i < argc ? 1 + 2 * argv[i] : 1;
+        break;
+      case I2C_SCRIPT_READ:
+        needed = 1;
+        break;
+      case I2C_SCRIPT_RESTART:
+        needed = 0;
+        break;
+      case I2C_SCRIPT_DELAY:
+        needed = 2;
+        break;
+      default:
+        Firmata.sendString(F("I2C: Unknown script operation"), op);
+        return;
+    }
+    if (i + needed > argc) {
+      Firmata.sendString(F("I2C: Script operation incomplete"), op);
+      return;
+    }
+    if ((op == I2C_SCRIPT_WRITE || op == I2C_SCRIPT_READ) && argv[i] > I2C_MAX_WRITE_BYTES) {
+      // Larger transfers don't fit the buffer of the Wire library
+      Firmata.sendString(F("I2C: Script transfer too long"), op);
+      return;
+    }
+    // The decoded operation has one byte per argument, except for the 14 bit delay
+    if (length + 1 + (op == I2C_SCRIPT_WRITE ? 1 + argv[i] : needed) > I2C_SCRIPT_MAX_LENGTH) {
+      Firmata.sendString(F("I2C: Script too long"));
+      return;
+    }
+    if (op != I2C_SCRIPT_ADDRESS && op != I2C_SCRIPT_DELAY && op != I2C_SCRIPT_RESTART && !hasAddress) {
+      Firmata.sendString(F("I2C: Script needs an address first"));
+      return;
+    }
+    script[length++] = op;
+    switch (op) {
+      case I2C_SCRIPT_ADDRESS:
+        script[length++] = argv[i];
+        hasAddress = true;
+        break;
+      case I2C_SCRIPT_WRITE:
+        script[length++] = argv[i];
+        for (byte b = 0; b < argv[i]; b++) {
+          script[length++] = argv[i + 1 + 2 * b] | (argv[i + 2 + 2 * b] << 7);
+        }
+        break;
+      case I2C_SCRIPT_READ:
+        readLength += argv[i];
+        if (readLength > I2C_SCRIPT_MAX_READ) {
+          Firmata.sendString(F("I2C: Script reads too many bytes"));
+          return;
+        }
+        script[length++] = argv[i];
+        break;
+      case I2C_SCRIPT_DELAY:
+        script[length++] = argv[i];
+        script[length++] = argv[i + 1];
+        break;
+    }
+    i += needed;
+  }
 
-  for (int i = 0; i < numBytes && Wire.available(); i++) {
-    i2cRxData[1 + i] = Wire.read();
+  i2c_job* job = enqueueJob();
+  if (job == nullptr) {
+    return;
   }
+  job->type = I2C_JOB_SCRIPT;
+  job->sequenceNo = argv[0];
+  scriptLength = length;
+  scriptQueued = true;
+}
+
+/*
+ * Executes all operations of the queued script at once. The reply contains the script id, the status
+ * (0 on success, otherwise the 1-based number of the operation that failed) and the data of all reads,
+ * in 7 bit encoding.
+ */
+void I2CFirmata::runScript(const i2c_job& job)
+{
+  byte rxData[I2C_SCRIPT_MAX_READ];
+  int received = 0;
+  byte address = 0;
+  bool stop = true;
+  byte status = 0;
+  byte opNumber = 0;
+  byte i = 0;
+  while (i < scriptLength && status == 0) {
+    byte op = script[i++];
+    opNumber++;
+    switch (op) {
+      case I2C_SCRIPT_ADDRESS:
+        address = script[i++];
+        break;
+      case I2C_SCRIPT_WRITE:
+      {
+        byte count = script[i++];
+        if (!bus->write(address, script + i, count, stop)) {
+          status = opNumber;
+        }
+        i += count;
+        stop = true;
+        break;
+      }
+      case I2C_SCRIPT_READ:
+      {
+        byte count = script[i++];
+        byte numBytes = readFromBus(address, rxData + received, count);
+        received += numBytes;
+        if (numBytes < count) {
+          status = opNumber;
+        }
+        break;
+      }
+      case I2C_SCRIPT_RESTART:
+        stop = false;
+        break;
+      case I2C_SCRIPT_DELAY:
+        delayMicroseconds(script[i] | (script[i + 1] << 7));
+        i += 2;
+        break;
+    }
+  }
+  scriptQueued = false;
+  busyUntil = micros() + I2C_WRITE_SETTLE_TIME;
+  busy = true;
 
-  // send slave address, register and received bytes
   Firmata.startSysex();
+  Firmata.write(I2C_SCRIPT);
+  Firmata.write(job.sequenceNo);
+  Firmata.write(status < 128 ? status : 127);
+  encoder.startBinaryWrite();
+  for (int b = 0; b < received; b++) {
+    encoder.writeBinary(rxData[b]);
+  }
+  encoder.endBinaryWrite();
+  Firmata.endSysex();
+}
+
+void I2CFirmata::completeRead(const i2c_job& job, byte numBytes)
+{
+  if (job.queryIndex >= 0) {
+    i2c_device_info& device = query[job.queryIndex];
+    device.pending = false;
+    // The value for the report template is made of the first (up to 4) bytes received, the first byte being the most significant
+    uint32_t value = 0;
+    for (byte i = 0; i < numBytes && i < 4; i++) {
+      value = (value << 8) | i2cRxData[1 + i];
+    }
+    device.lastValue = (int32_t)value;
+    if (device.inTemplate) {
+      return;
+    }
+#ifdef LARGE_MEM_DEVICE
+    if (isUnchanged(device, numBytes)) {
+      return;
+    }
+#endif
+  }
+  sendReply(job, numBytes, true);
+}
+
+/*
+ * Sends the register and the data in i2cRxData. With I2C_CONFIG_PACKED_REPLIES, the reply is an I2C_REPLY_PACKED:
+ * slave address, sequence number, register (2 bytes), offset of the data (2 bytes), 1 if it's the last chunk,
+ * data in 7 bit encoding. Otherwise, each chunk of a large read is sent as an ordinary I2C_REPLY.
+ */
+void I2CFirmata::sendReply(const i2c_job& job, byte numBytes, bool last)
+{
+  Firmata.sendTimestamp();
+  Firmata.startSysex();
+  if (configOptions & I2C_CONFIG_PACKED_REPLIES) {
+    Firmata.write(I2C_REPLY_PACKED);
+    Firmata.write(job.address);
+    Firmata.write(job.sequenceNo);
+    Firmata.sendValueAsTwo7bitBytes(i2cRxData[0]);
+    Firmata.sendPackedUInt14(job.offset);
+    Firmata.write(last ? 1 : 0);
+    encoder.startBinaryWrite();
+    for (int i = 1; i < numBytes + 1; i++) {
+      encoder.writeBinary(i2cRxData[i]);
+    }
+    encoder.endBinaryWrite();
+    Firmata.endSysex();
+    return;
+  }
+  // send slave address, register and received bytes
   Firmata.write(I2C_REPLY);
-  Firmata.write(address); // Slave address, LSB (always < 128 in 7 bit mode)
-  Firmata.write(seqenceNo); // Slave address, MSB. This is abused here, but a client that doesn't use the sequencing will always send 0 and be happy
+  Firmata.write(job.address); // Slave address, LSB (always < 128 in 7 bit mode)
+  Firmata.write(job.sequenceNo); // Slave address, MSB. This is abused here, but a client that doesn't use the sequencing will always send 0 and be happy
   for (int i = 0; i < numBytes + 1; i++) {
       Firmata.sendValueAsTwo7bitBytes(i2cRxData[i]);
   }
   Firmata.endSysex();
 }
 
+#ifdef LARGE_MEM_DEVICE
+/*
+ * For queries with I2C_QUERY_CHANGES_ONLY: Returns true if the data received is the same as the data of the last reply
+ * and the max silence hasn't expired yet. Only a FNV-1a hash of the data is kept.
+ */
+bool I2CFirmata::isUnchanged(i2c_device_info& device, byte numBytes)
+{
+  if ((device.options & I2C_QUERY_CHANGES_ONLY) == 0) {
+    return false;
+  }
+  uint32_t hash = 2166136261UL;
+  for (int i = 0; i < numBytes + 1; i++) {
+    hash = (hash ^ i2cRxData[i]) * 16777619UL;
+  }
+  hash = (hash ^ numBytes) * 16777619UL;
+  if (hash == 0) {
+    hash = 1;
+  }
+  uint16_t now = (uint16_t)(millis() / 100);
+  if (hash == device.dataHash && (device.maxSilence == 0 || (uint16_t)(now - device.lastReply) < device.maxSilence)) {
+    return true;
+  }
+  device.dataHash = hash;
+  device.lastReply = now;
+  return false;
+}
+#endif
+
 boolean I2CFirmata::handlePinMode(byte pin, int mode)
 {
   if (IS_PIN_I2C(pin)) {
@@ -99,6 +551,12 @@ boolean I2CFirmata::handleSysex(byte command, byte argc, byte* argv)
     break;
   case I2C_CONFIG:
     return handleI2CConfig(argc, argv);
+  case I2C_SCRIPT:
+    if (isI2CEnabled) {
+      handleI2CScript(argc, argv);
+      return true;
+    }
+    break;
   }
   return false;
 }
@@ -108,7 +566,7 @@ void I2CFirmata::handleI2CRequest(byte argc, byte* argv)
   byte mode;
   byte stopTX;
   byte slaveAddress;
-  byte data;
+  unsigned int data;
   int slaveRegister;
   mode = argv[1] & I2C_READ_WRITE_MODE_MASK;
   if (argv[1] & I2C_10BIT_ADDRESS_MODE_MASK) {
@@ -132,14 +590,37 @@ void I2CFirmata::handleI2CRequest(byte argc, byte* argv)
 
   switch (mode) {
   case I2C_WRITE:
-    Wire.beginTransmission(slaveAddress);
-    for (byte i = 2; i < argc; i += 2) {
-      data = argv[i] + (argv[i + 1] << 7);
-      Wire.write(data);
+  {
+    byte length = (argc - 2) / 2;
+    if (length > I2C_MAX_WRITE_BYTES) {
+      Firmata.sendString(F("I2C: Too many bytes to write"));
+      break;
+    }
+    // The data is decoded in place, the sysex buffer isn't used anymore after this
+    for (byte i = 0; i < length; i++) {
+      argv[i] = argv[2 + 2 * i] + (argv[3 + 2 * i] << 7);
     }
-    Wire.endTransmission();
-    delayMicroseconds(70);
+    if (isBusIdle()) {
+      writeToBus(slaveAddress, argv, length, true);
+      break;
+    }
+    // The buffer only grows at the end and is reset when it's empty, so the data of each write stays contiguous
+    if (writeHead + writeUsed + length > I2C_WRITE_BUFFER_SIZE) {
+      Firmata.sendString(F("I2C: Write buffer full"));
+      break;
+    }
+    i2c_job* job = enqueueJob();
+    if (job == nullptr) {
+      break;
+    }
+    job->type = I2C_JOB_WRITE;
+    job->address = slaveAddress;
+    job->stopTX = I2C_STOP_TX;
+    job->length = length;
+    memcpy(writeBuffer + writeHead + writeUsed, argv, length);
+    writeUsed += length;
     break;
+  }
   case I2C_READ:
     if (argc == 6) {
       // a slave register is specified
@@ -151,15 +632,42 @@ void I2CFirmata::handleI2CRequest(byte argc, byte* argv)
       slaveRegister = I2C_REGISTER_NOT_SPECIFIED;
       data = argv[2] + (argv[3] << 7);  // bytes to read
     }
-    readAndReportData(slaveAddress, (int)slaveRegister, data, stopTX, sequenceNo);
+    {
+      i2c_job* job = enqueueJob();
+      if (job == nullptr) {
+        break;
+      }
+      job->type = I2C_JOB_READ;
+      job->address = slaveAddress;
+      job->reg = slaveRegister;
+      job->length = data;
+      job->stopTX = stopTX;
+      job->sequenceNo = sequenceNo;
+    }
     break;
   case I2C_READ_CONTINUOUSLY:
-    if ((queryIndex + 1) >= I2C_MAX_QUERIES) {
+  {
+    if (queryCount >= I2C_MAX_QUERIES) {
       // too many queries, just ignore
       Firmata.sendString(F("too many queries"));
       break;
     }
-    if (argc == 6) {
+    // Optional at the end: interval in ms and phase offset in ms (14 bits each),
+    // optionally followed by the query options and the max silence in 100ms (14 bits)
+    uint16_t interval = 0;
+    uint16_t phase = 0;
+    byte options = 0;
+    uint16_t maxSilence = 0;
+    if (argc == 11 || argc == 13) {
+      options = argv[argc - 3];
+      maxSilence = Firmata.decodePackedUInt14(argv + argc - 2);
+      argc -= 3;
+    }
+    if (argc == 8 || argc == 10) {
+      interval = Firmata.decodePackedUInt14(argv + argc - 4);
+      phase = Firmata.decodePackedUInt14(argv + argc - 2);
+    }
+    if (argc == 6 || argc == 10) {
       // a slave register is specified
       slaveRegister = argv[2] + (argv[3] << 7);
       data = argv[4] + (argv[5] << 7);  // bytes to read
@@ -169,40 +677,42 @@ void I2CFirmata::handleI2CRequest(byte argc, byte* argv)
       slaveRegister = (int)I2C_REGISTER_NOT_SPECIFIED;
       data = argv[2] + (argv[3] << 7);  // bytes to read
     }
-    queryIndex++;
-    query[queryIndex].addr = slaveAddress;
-    query[queryIndex].reg = slaveRegister;
-    query[queryIndex].bytes = data;
-    query[queryIndex].stopTX = stopTX;
+    i2c_device_info& device = query[queryCount++];
+    device.addr = slaveAddress;
+    device.reg = slaveRegister;
+    // continuous reads are limited to a single chunk
+    device.bytes = data <= I2C_READ_CHUNK_SIZE ? data : I2C_READ_CHUNK_SIZE;
+    device.stopTX = stopTX;
+    device.inTemplate = false;
+    device.pending = false;
+    device.lastValue = 0;
+    device.interval = interval;
+    device.nextRead = (uint16_t)millis() + phase;
+#ifdef LARGE_MEM_DEVICE
+    device.options = options;
+    device.maxSilence = maxSilence;
+    device.lastReply = 0;
+    device.dataHash = 0;
+#else
+    if (options & I2C_QUERY_CHANGES_ONLY) {
+      Firmata.sendString(F("I2C: Changes-only queries not supported, sending all replies"));
+    }
+#endif
     break;
+  }
   case I2C_STOP_READING:
-    byte queryIndexToSkip;
-    // if read continuous mode is enabled for only 1 i2c device, disable
-    // read continuous reporting for that device
-    if (queryIndex <= 0) {
-      queryIndex = -1;
+    // Stops all queries of the given device, or only the one of the given register
+    if (argc >= 4) {
+      slaveRegister = argv[2] + (argv[3] << 7);
     }
     else {
-      queryIndexToSkip = 0;
-      // if read continuous mode is enabled for multiple devices,
-      // determine which device to stop reading and remove it's data from
-      // the array, shifiting other array data to fill the space
-      for (byte i = 0; i < queryIndex + 1; i++) {
-        if (query[i].addr == slaveAddress) {
-          queryIndexToSkip = i;
-          break;
-        }
-      }
-
-      for (byte i = queryIndexToSkip; i < queryIndex + 1; i++) {
-        if (i < I2C_MAX_QUERIES) {
-          query[i].addr = query[i + 1].addr;
-          query[i].reg = query[i + 1].reg;
-          query[i].bytes = query[i + 1].bytes;
-          query[i].stopTX = query[i + 1].stopTX;
-        }
+      slaveRegister = I2C_REGISTER_NOT_SPECIFIED;
+    }
+    for (byte i = queryCount; i > 0; i--) {
+      const i2c_device_info& device = query[i - 1];
+      if (device.addr == slaveAddress && (slaveRegister == I2C_REGISTER_NOT_SPECIFIED || device.reg == slaveRegister)) {
+        removeQuery(i - 1);
       }
-      queryIndex--;
     }
     break;
   default:
@@ -214,6 +724,11 @@ boolean I2CFirmata::handleI2CConfig(byte argc, byte* argv)
 {
   unsigned int delayTime = (argv[0] + (argv[1] << 7));
 
+  // Optional: options byte
+  if (argc >= 3) {
+    configOptions = argv[2];
+  }
+
   if (delayTime > 0) {
     i2cReadDelayTime = delayTime;
   }
@@ -242,14 +757,7 @@ boolean I2CFirmata::enableI2CPins()
 
   isI2CEnabled = true;
 
-  Wire.end();
-#ifdef ARDUINO_M5STACK_Core2
-    // For the M5Stack, we explicitly choose the pins, because we want to use the internal I2C bus by default
-    // It has the on-board devices attached: touchscreen, RTC, power controller and IMU (Core2 only)
-  Wire.begin(21, 22);
-#else
-  Wire.begin();
-#endif
+  bus->begin();
   return true;
 }
 
@@ -258,7 +766,8 @@ void I2CFirmata::disableI2CPins()
 {
   isI2CEnabled = false;
   // disable read continuous mode for all devices
-  queryIndex = -1;
+  queryCount = 0;
+  clearJobs();
   // uncomment the following if or when the end() method is added to Wire library
   // Wire.end();
 }
@@ -268,14 +777,58 @@ void I2CFirmata::reset()
   if (isI2CEnabled) {
     disableI2CPins();
   }
+  configOptions = 0;
 }
 
 void I2CFirmata::report(bool elapsed)
 {
-  // report i2c data for all device with read continuous mode enabled
-  if (queryIndex > -1) {
-    for (byte i = 0; i < queryIndex + 1; i++) {
-      readAndReportData(query[i].addr, query[i].reg, query[i].bytes, query[i].stopTX, 0);
+  if (!isI2CEnabled) {
+    return;
+  }
+  // mark the continuous queries that are due, unless the last read is still pending.
+  // Queries without an interval are read every sampling interval.
+  // The intervals are at most 14 bits, so the lower 16 bits of millis() are enough
+  uint16_t now = (uint16_t)millis();
+  for (byte i = 0; i < queryCount; i++) {
+    i2c_device_info& device = query[i];
+    if (device.interval == 0) {
+      if (!elapsed || device.pending) {
+        continue;
+      }
+    }
+    else {
+      if ((int16_t)(now - device.nextRead) < 0 || device.pending) {
+        continue;
+      }
+      device.nextRead += device.interval;
+      // don't try to catch up after a long stall
+      if ((int16_t)(now - device.nextRead) >= 0) {
+        device.nextRead = now + device.interval;
+      }
     }
+    device.pending = true;
+  }
+  processJobs();
+}
+
+/*
+ * Continuous reads that are part of the report template don't send I2C_REPLY messages anymore.
+ * The template gets the value of the last completed read.
+ */
+bool I2CFirmata::readReportSource(byte sourceType, byte index, int32_t* value)
+{
+  if (sourceType != REPORT_SOURCE_I2C_QUERY || index >= queryCount || templateInvalid) {
+    return false;
+  }
+  query[index].inTemplate = true;
+  *value = query[index].lastValue;
+  return true;
+}
+
+void I2CFirmata::reportTemplateChanged()
+{
+  templateInvalid = false;
+  for (byte i = 0; i < I2C_MAX_QUERIES; i++) {
+    query[i].inTemplate = false;
   }
 }
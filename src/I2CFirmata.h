@@ -25,6 +25,8 @@
 #include <ConfigurableFirmata.h>
 #include "FirmataFeature.h"
 #include "FirmataReporting.h"
+#include "I2CBus.h"
+#include "Encoder7Bit.h"
 
 #define I2C_WRITE                   0B00000000
 #define I2C_READ                    0B00001000
@@ -36,8 +38,58 @@
 #define I2C_10BIT_ADDRESS_MASK      0B00000111
 #define I2C_STOP_TX                 1
 #define I2C_RESTART_TX              0
-#define I2C_MAX_QUERIES             8
 #define I2C_REGISTER_NOT_SPECIFIED  -1
+#define I2C_WRITE_SETTLE_TIME       70 // us between a write and the next transfer, some devices need this
+#define I2C_MAX_WRITE_BYTES         32 // the buffer size of the Wire library
+#define I2C_READ_CHUNK_SIZE         32 // larger reads are split in several transfers and replies
+
+// Options of I2C_CONFIG
+#define I2C_CONFIG_PACKED_REPLIES   0x01 // send I2C_REPLY_PACKED instead of I2C_REPLY
+
+#ifdef LARGE_MEM_DEVICE
+#define I2C_JOB_QUEUE_SIZE          16
+#define I2C_WRITE_BUFFER_SIZE       256 // data of all queued writes
+#else
+#define I2C_JOB_QUEUE_SIZE          2
+#define I2C_WRITE_BUFFER_SIZE       I2C_MAX_WRITE_BYTES
+#endif
+
+// Number of continuous queries. Can be overridden with a build flag (-DI2C_MAX_QUERIES=n), but not with a define in
+// the sketch: the library is compiled separately and would use a different size of I2CFirmata.
+#ifndef I2C_MAX_QUERIES
+#ifdef LARGE_MEM_DEVICE
+#define I2C_MAX_QUERIES             24
+#else
+#define I2C_MAX_QUERIES             8
+#endif
+#endif
+
+#if I2C_MAX_QUERIES > 127
+#error "I2C_MAX_QUERIES must not be larger than 127"
+#endif
+
+// Operations of an I2C_SCRIPT
+#define I2C_SCRIPT_ADDRESS          0x00 // select the slave address: address
+#define I2C_SCRIPT_WRITE            0x01 // write bytes: count, bytes as two 7 bit bytes each
+#define I2C_SCRIPT_READ             0x02 // read bytes: count
+#define I2C_SCRIPT_RESTART          0x03 // the next write ends with a repeated start instead of a stop condition
+#define I2C_SCRIPT_DELAY            0x04 // wait: us (14 bits)
+
+#ifdef LARGE_MEM_DEVICE
+#define I2C_SCRIPT_MAX_LENGTH       128 // decoded operations
+#define I2C_SCRIPT_MAX_READ         128 // bytes read by all operations together
+#else
+#define I2C_SCRIPT_MAX_LENGTH       32
+#define I2C_SCRIPT_MAX_READ         32
+#endif
+
+// Options of a continuous query. Only supported on boards with LARGE_MEM_DEVICE, the state takes 9 bytes per query.
+#define I2C_QUERY_CHANGES_ONLY      0x01 // only send I2C_REPLY when the data changed or the max silence expired
+
+#define I2C_JOB_NONE                0 // cancelled
+#define I2C_JOB_WRITE               1
+#define I2C_JOB_READ                2
+#define I2C_JOB_SCRIPT              3
 
 /* i2c data */
 struct i2c_device_info {
@@ -45,8 +97,40 @@ struct i2c_device_info {
   int reg;
   byte bytes;
   byte stopTX;
+  bool inTemplate; // part of the report template, no I2C_REPLY is sent
+  bool pending;    // a read is due or running
+  int32_t lastValue; // first (up to 4) bytes of the last read, for the report template
+  uint16_t interval; // in ms, 0 = every sampling interval
+  uint16_t nextRead; // lower 16 bits of millis() of the next read, if an interval is set
+#ifdef LARGE_MEM_DEVICE
+  byte options;
+  uint16_t maxSilence; // in 100ms, 0 = never repeat unchanged data
+  uint16_t lastReply; // millis() / 100 of the last I2C_REPLY
+  uint32_t dataHash; // of the last data sent, 0 = nothing sent yet
+#endif
+};
+
+struct i2c_job {
+  byte type;
+  byte address;
+  int reg;
+  uint16_t length; // bytes to write or to read
+  uint16_t offset; // bytes read so far
+  byte stopTX;
+  byte sequenceNo;
+  signed char queryIndex; // the continuous query this read belongs to, -1 for single reads
 };
 
+/*
+ * I2C requests of the host are executed by a job queue, one bus transfer per loop iteration. The delays between the
+ * transfers (the configured read delay and the settle time after writes) don't block the loop.
+ * A write is executed right away if the bus is idle. Otherwise its data is appended to a write buffer shared by
+ * all queued writes, which are executed in order.
+ * Continuous queries don't use the queue: the ones that are due are read round-robin, taking turns with the queued jobs.
+ * Replies are sent when a read completes. Reads larger than I2C_READ_CHUNK_SIZE are executed in several transfers
+ * and each chunk is sent as soon as it is received.
+ * An I2C_SCRIPT is executed as a single job, so no other transfer can come in between its operations.
+ */
 class I2CFirmata: public FirmataFeature
 {
   public:
@@ -56,18 +140,67 @@ class I2CFirmata: public FirmataFeature
     boolean handleSysex(byte command, byte argc, byte* argv);
     void reset();
     void report(bool elapsed) override;
+    bool readReportSource(byte sourceType, byte index, int32_t* value) override;
+    void reportTemplateChanged() override;
+    void setBus(I2CBus& bus);
 
   private:
+    enum class JobState
+    {
+      Idle,
+      WaitForRead, // the register was written, waiting for the read delay
+      ReadingChunks, // the first chunk of a large read was received
+    };
+
     /* for i2c read continuous more */
     i2c_device_info query[I2C_MAX_QUERIES];
 
-    byte i2cRxData[32];
+    byte i2cRxData[I2C_READ_CHUNK_SIZE + 1]; // register and data
     boolean isI2CEnabled;
-    signed char queryIndex;
+    byte configOptions;
+    byte queryCount;
+    bool templateInvalid; // a query of the report template was removed or moved to another index
     unsigned int i2cReadDelayTime;  // default delay time between i2c read request and Wire.requestFrom()
 
-    void readAndReportData(byte address, int theRegister, byte numBytes, byte stopTX, byte seqenceNo);
+    /* job queue */
+    I2CBus* bus;
+    i2c_job jobs[I2C_JOB_QUEUE_SIZE];
+    byte jobHead;
+    byte jobCount;
+    JobState jobState;
+    uint32_t busyUntil; // micros() before which the next transfer may not start
+    bool busy;
+    i2c_job queryJob; // the read of the continuous query that is running
+    bool queryActive;
+    byte nextQuery; // where the round-robin search for due queries continues
+    bool queryTurn; // the next transfer is a continuous query, if one is due
+    byte writeBuffer[I2C_WRITE_BUFFER_SIZE]; // data of the queued writes, oldest first
+    uint16_t writeHead; // start of the data of the oldest queued write
+    uint16_t writeUsed;
+
+    /* the script of the queued I2C_SCRIPT job */
+    byte script[I2C_SCRIPT_MAX_LENGTH];
+    byte scriptLength;
+    bool scriptQueued;
+    Encoder7BitClass encoder;
+
+    i2c_job* enqueueJob();
+    void processJobs();
+    void finishJob();
+    bool isBusIdle();
+    void writeToBus(byte address, const byte* data, byte length, bool stop);
+    void clearJobs();
+    void removeQuery(byte index);
+    bool startQuery();
+    byte readFromBus(byte address, byte* buffer, byte length);
+    void completeRead(const i2c_job& job, byte numBytes);
+    void sendReply(const i2c_job& job, byte numBytes, bool last);
+#ifdef LARGE_MEM_DEVICE
+    bool isUnchanged(i2c_device_info& device, byte numBytes);
+#endif
     void handleI2CRequest(byte argc, byte *argv);
+    void handleI2CScript(byte argc, byte *argv);
+    void runScript(const i2c_job& job);
     boolean handleI2CConfig(byte argc, byte *argv);
     boolean enableI2CPins();
     void disableI2CPins();
@@ -0,0 +1,430 @@
+/*
+  LogicAnalyzerFirmata.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <ConfigurableFirmata.h>
+#include "LogicAnalyzerFirmata.h"
+
+#ifndef ARDUINO_ISR_ATTR
+#define ARDUINO_ISR_ATTR
+#endif
+
+LogicAnalyzerFirmata *LogicAnalyzerFirmataInstance;
+
+
+LogicAnalyzerFirmata::LogicAnalyzerFirmata()
+{
+  LogicAnalyzerFirmataInstance = this;
+  state = CaptureState::Idle;
+  buffer = nullptr;
+  firstPort = 0;
+  portCount = 1;
+  timerActive = false;
+  samplePeriod = 0;
+  sampleCount = 0;
+  preTrigger = 0;
+  writeIndex = 0;
+  samplesTaken = 0;
+  triggerSample = 0;
+  nextSampleTime = 0;
+  captureStart = 0;
+  captureEnd = 0;
+  captureDuration = 0;
+  triggerMode = LOGIC_ANALYZER_TRIGGER_NONE;
+  triggerMask = 0;
+  triggerValue = 0;
+  lastTriggerPort = 0;
+  sendStart = 0;
+  sendPosition = 0;
+  sendCount = 0;
+  chunkIndex = 0;
+#ifdef ESP32
+  timer = nullptr;
+#endif
+}
+
+void LogicAnalyzerFirmata::handleCapability(byte pin)
+{
+}
+
+boolean LogicAnalyzerFirmata::handlePinMode(byte pin, int mode)
+{
+  // The analyzer only reads the ports, it works with pins in any mode
+  return false;
+}
+
+boolean LogicAnalyzerFirmata::handleSysex(byte command, byte argc, byte* argv)
+{
+  if (command != LOGIC_ANALYZER || argc < 1) {
+    return false;
+  }
+  if (argv[0] == LOGIC_ANALYZER_START) {
+    startCapture(argc - 1, argv + 1);
+    return true;
+  }
+  if (argv[0] == LOGIC_ANALYZER_ABORT) {
+    stopCapture();
+    return true;
+  }
+  return false;
+}
+
+/*
+ * Format: first port, port count, sample period in us (packed uint32), number of samples (packed uint32),
+ * trigger mode, trigger mask (2 bytes), trigger value (2 bytes), optionally followed by the number of
+ * samples to keep from before the trigger (packed uint32)
+ */
+void LogicAnalyzerFirmata::startCapture(byte argc, byte* argv)
+{
+  stopCapture();
+  if (argc < 17) {
+    Firmata.sendString(F("Error in logic analyzer command: Not enough parameters"));
+    return;
+  }
+  firstPort = argv[0];
+  portCount = argv[1];
+  if (portCount == 0 || portCount > LOGIC_ANALYZER_MAX_PORTS || firstPort + portCount > TOTAL_PORTS) {
+    Firmata.sendString(F("Invalid port range for logic analyzer"));
+    return;
+  }
+  samplePeriod = Firmata.decodePackedUInt32(argv + 2);
+  sampleCount = Firmata.decodePackedUInt32(argv + 7);
+  if (sampleCount == 0 || sampleCount > LOGIC_ANALYZER_BUFFER_SIZE / portCount) {
+    sampleCount = LOGIC_ANALYZER_BUFFER_SIZE / portCount;
+  }
+  triggerMode = argv[12];
+  triggerMask = argv[13] | (argv[14] << 7);
+  triggerValue = argv[15] | (argv[16] << 7);
+  preTrigger = 0;
+  if (argc >= 22 && triggerMode != LOGIC_ANALYZER_TRIGGER_NONE && samplePeriod != 0) {
+    preTrigger = Firmata.decodePackedUInt32(argv + 17);
+    if (preTrigger >= sampleCount) {
+      preTrigger = sampleCount - 1;
+    }
+  }
+
+  buffer = (byte*)malloc(sampleCount * portCount);
+  if (buffer == nullptr) {
+    Firmata.sendString(F("Not enough memory for logic analyzer"));
+    return;
+  }
+  writeIndex = 0;
+  samplesTaken = 0;
+  lastTriggerPort = readPort(firstPort, 0xFF);
+  nextSampleTime = micros();
+  state = CaptureState::Armed;
+#ifdef LOGIC_ANALYZER_HW_TIMER
+  if (samplePeriod != 0) {
+    timerActive = startTimer();
+  }
+#endif
+}
+
+void LogicAnalyzerFirmata::stopCapture()
+{
+#ifdef LOGIC_ANALYZER_HW_TIMER
+  if (timerActive) {
+    stopTimer();
+  }
+#endif
+  state = CaptureState::Idle;
+  if (buffer != nullptr) {
+    free(buffer);
+    buffer = nullptr;
+  }
+}
+
+bool ARDUINO_ISR_ATTR LogicAnalyzerFirmata::isTriggered(byte value)
+{
+  byte changed = (value ^ lastTriggerPort) & triggerMask;
+  switch (triggerMode) {
+    case LOGIC_ANALYZER_TRIGGER_NONE:
+      return true;
+    case LOGIC_ANALYZER_TRIGGER_RISING:
+      return (changed & value) != 0;
+    case LOGIC_ANALYZER_TRIGGER_FALLING:
+      return (changed & ~value) != 0;
+    case LOGIC_ANALYZER_TRIGGER_CHANGE:
+      return changed != 0;
+    case LOGIC_ANALYZER_TRIGGER_PATTERN:
+      return (value & triggerMask) == (triggerValue & triggerMask);
+  }
+  return false;
+}
+
+/*
+ * Stores one frame in the ring buffer and checks the trigger. While armed, the buffer keeps overwriting the
+ * oldest frames; once triggered, the capture ends when the frames after the trigger fill the rest of the buffer.
+ * Called from the timer interrupt or from the main loop.
+ */
+void ARDUINO_ISR_ATTR LogicAnalyzerFirmata::takeSample()
+{
+  byte* data = buffer + writeIndex * portCount;
+  for (byte p = 0; p < portCount; p++) {
+    data[p] = readPort(firstPort + p, 0xFF);
+  }
+  if (++writeIndex >= sampleCount) {
+    writeIndex = 0;
+  }
+  if (samplesTaken++ == 0) {
+    captureStart = micros();
+  }
+
+  if (state == CaptureState::Armed) {
+    bool triggered = isTriggered(data[0]);
+    lastTriggerPort = data[0];
+    if (!triggered) {
+      return;
+    }
+    triggerSample = samplesTaken - 1;
+    state = CaptureState::Capturing;
+  }
+  if (samplesTaken - triggerSample >= sampleCount - preTrigger) {
+    captureEnd = micros();
+    state = CaptureState::Done;
+  }
+}
+
+/*
+ * Waits a limited time for the trigger, then takes all samples at once with interrupts disabled. The capture is
+ * bounded by the buffer size, a few ms at most. The measured duration is only accurate on boards whose micros()
+ * doesn't depend on interrupts for such a short time.
+ */
+void LogicAnalyzerFirmata::captureBurst()
+{
+  uint32_t pollStart = micros();
+  byte value = readPort(firstPort, 0xFF);
+  while (!isTriggered(value)) {
+    lastTriggerPort = value;
+    if ((uint32_t)(micros() - pollStart) >= LOGIC_ANALYZER_TRIGGER_POLL_US) {
+      return;
+    }
+    value = readPort(firstPort, 0xFF);
+  }
+
+  noInterrupts();
+  captureStart = micros();
+  if (portCount == 1) {
+    byte port = firstPort;
+    for (uint32_t i = 0; i < sampleCount; i++) {
+      buffer[i] = readPort(port, 0xFF);
+    }
+  } else {
+    byte* data = buffer;
+    for (uint32_t i = 0; i < sampleCount; i++) {
+      for (byte p = 0; p < portCount; p++) {
+        *data++ = readPort(firstPort + p, 0xFF);
+      }
+    }
+  }
+  captureEnd = micros();
+  interrupts();
+  writeIndex = 0;
+  samplesTaken = sampleCount;
+  triggerSample = 0;
+  state = CaptureState::Done;
+}
+
+/*
+ * Stops the sampling and prepares sending the buffer, starting with the oldest frame.
+ */
+void LogicAnalyzerFirmata::finishCapture()
+{
+#ifdef LOGIC_ANALYZER_HW_TIMER
+  if (timerActive) {
+    stopTimer();
+  }
+#endif
+  if (samplesTaken < sampleCount) {
+    sendStart = 0;
+    sendCount = samplesTaken;
+  } else {
+    sendStart = writeIndex;
+    sendCount = sampleCount;
+  }
+  // The duration of the frames sent, derived from the duration of all samples taken
+  captureDuration = 0;
+  if (samplesTaken > 1) {
+    captureDuration = (uint32_t)((uint64_t)(captureEnd - captureStart) * (sendCount - 1) / (samplesTaken - 1));
+  }
+  sendPosition = 0;
+  chunkIndex = 0;
+  state = CaptureState::Sending;
+}
+
+byte* LogicAnalyzerFirmata::frameAt(uint32_t position)
+{
+  uint32_t index = sendStart + position;
+  if (index >= sampleCount) {
+    index -= sampleCount;
+  }
+  return buffer + index * portCount;
+}
+
+/*
+ * Sends the next chunk of samples. Each record consists of one byte per port followed by
+ * the number of consecutive samples (1-255) with this value.
+ */
+void LogicAnalyzerFirmata::sendChunk()
+{
+  byte chunk[LOGIC_ANALYZER_CHUNK_SIZE];
+  int length = 0;
+  while (sendPosition < sendCount && length + portCount + 1 <= LOGIC_ANALYZER_CHUNK_SIZE) {
+    byte* frame = frameAt(sendPosition);
+    byte run = 1;
+    while (run < 255 && sendPosition + run < sendCount && memcmp(frame, frameAt(sendPosition + run), portCount) == 0) {
+      run++;
+    }
+    memcpy(chunk + length, frame, portCount);
+    length += portCount;
+    chunk[length++] = run;
+    sendPosition += run;
+  }
+
+  Firmata.startSysex();
+  Firmata.write(LOGIC_ANALYZER);
+  Firmata.write(LOGIC_ANALYZER_DATA);
+  Firmata.sendPackedUInt14(chunkIndex++);
+  encoder.startBinaryWrite();
+  for (int i = 0; i < length; i++) {
+    encoder.writeBinary(chunk[i]);
+  }
+  encoder.endBinaryWrite();
+  Firmata.endSysex();
+
+  if (sendPosition >= sendCount) {
+    // The position of the trigger within the frames sent
+    uint32_t triggerPosition = triggerSample - (samplesTaken - sendCount);
+    Firmata.startSysex();
+    Firmata.write(LOGIC_ANALYZER);
+    Firmata.write(LOGIC_ANALYZER_DONE);
+    Firmata.write(firstPort);
+    Firmata.write(portCount);
+    Firmata.sendPackedUInt32(sendCount);
+    Firmata.sendPackedUInt32(captureDuration);
+    Firmata.sendPackedUInt32(triggerPosition);
+    Firmata.endSysex();
+    stopCapture();
+  }
+}
+
+void LogicAnalyzerFirmata::report(bool elapsed)
+{
+  switch (state) {
+    case CaptureState::Idle:
+      break;
+    case CaptureState::Armed:
+    case CaptureState::Capturing:
+      if (samplePeriod == 0) {
+        captureBurst();
+      } else if (!timerActive && (int32_t)(micros() - nextSampleTime) >= 0) {
+        // Without a timer, one sample is taken per loop pass when it is due
+        nextSampleTime += samplePeriod;
+        takeSample();
+      }
+      break;
+    case CaptureState::Done:
+      finishCapture();
+      break;
+    case CaptureState::Sending:
+      // One chunk per loop, so the transfer doesn't block other features
+      sendChunk();
+      break;
+  }
+}
+
+void LogicAnalyzerFirmata::reset()
+{
+  stopCapture();
+}
+
+#ifdef LOGIC_ANALYZER_HW_TIMER
+void ARDUINO_ISR_ATTR LogicAnalyzerFirmata::timerIsr()
+{
+  LogicAnalyzerFirmata* self = LogicAnalyzerFirmataInstance;
+  CaptureState current = self->state;
+  if (current == CaptureState::Armed || current == CaptureState::Capturing) {
+    self->takeSample();
+  }
+}
+#endif
+
+#ifdef ESP32
+bool LogicAnalyzerFirmata::startTimer()
+{
+  uint32_t period = samplePeriod < LOGIC_ANALYZER_MIN_PERIOD_US ? LOGIC_ANALYZER_MIN_PERIOD_US : samplePeriod;
+  if (timer == nullptr) {
+    timer = timerBegin(1000000); // 1us resolution
+    if (timer == nullptr) {
+      return false;
+    }
+    timerAttachInterrupt(timer, timerIsr);
+  }
+  timerStop(timer);
+  timerWrite(timer, 0);
+  timerAlarm(timer, period, true, 0);
+  timerStart(timer);
+  return true;
+}
+
+void LogicAnalyzerFirmata::stopTimer()
+{
+  timerStop(timer);
+  timerActive = false;
+}
+#endif
+
+#ifdef LOGIC_ANALYZER_TIMER1
+ISR(TIMER1_COMPA_vect)
+{
+  LogicAnalyzerFirmata::timerIsr();
+}
+
+/*
+ * Runs Timer1 in CTC mode with the smallest prescaler that fits the period. Returns false if the period
+ * is too long for the timer, the samples are then taken from the main loop.
+ */
+bool LogicAnalyzerFirmata::startTimer()
+{
+  static const uint16_t prescalers[] = { 1, 8, 64, 256, 1024 };
+  static const byte clockSelect[] = { _BV(CS10), _BV(CS11), _BV(CS11) | _BV(CS10), _BV(CS12), _BV(CS12) | _BV(CS10) };
+  uint32_t period = samplePeriod < LOGIC_ANALYZER_MIN_PERIOD_US ? LOGIC_ANALYZER_MIN_PERIOD_US : samplePeriod;
+  uint32_t cycles = period * (F_CPU / 1000000UL);
+  byte i = 0;
+  while (i < 5 && cycles / prescalers[i] > 65536) {
+    i++;
+  }
+  if (i == 5) {
+    return false;
+  }
+  noInterrupts();
+  TCCR1A = 0;
+  TCCR1B = _BV(WGM12) | clockSelect[i];
+  TCNT1 = 0;
+  OCR1A = (uint16_t)(cycles / prescalers[i] - 1);
+  TIFR1 = _BV(OCF1A);
+  TIMSK1 = _BV(OCIE1A);
+  interrupts();
+  return true;
+}
+
+/*
+ * Restores the configuration of the Arduino core (8 bit phase correct PWM, prescaler 64)
+ */
+void LogicAnalyzerFirmata::stopTimer()
+{
+  noInterrupts();
+  TIMSK1 = 0;
+  TCCR1B = _BV(CS11) | _BV(CS10);
+  TCCR1A = _BV(WGM10);
+  interrupts();
+  timerActive = false;
+}
+#endif
@@ -0,0 +1,136 @@
+/*
+  LogicAnalyzerFirmata.h - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef LogicAnalyzerFirmata_h
+#define LogicAnalyzerFirmata_h
+
+#include <ConfigurableFirmata.h>
+#include "FirmataFeature.h"
+#include "Encoder7Bit.h"
+
+#define LOGIC_ANALYZER_START            0x00 // arm a capture
+#define LOGIC_ANALYZER_ABORT            0x01 // abort a running capture or transfer
+#define LOGIC_ANALYZER_DATA             0x02 // reply: a chunk of run-length encoded samples
+#define LOGIC_ANALYZER_DONE             0x03 // reply: all samples have been sent
+
+#define LOGIC_ANALYZER_TRIGGER_NONE     0x00 // start immediately
+#define LOGIC_ANALYZER_TRIGGER_RISING   0x01 // any of the trigger pins goes high
+#define LOGIC_ANALYZER_TRIGGER_FALLING  0x02 // any of the trigger pins goes low
+#define LOGIC_ANALYZER_TRIGGER_CHANGE   0x03 // any of the trigger pins changes
+#define LOGIC_ANALYZER_TRIGGER_PATTERN  0x04 // the trigger pins match the given value
+
+#ifdef LARGE_MEM_DEVICE
+#define LOGIC_ANALYZER_BUFFER_SIZE      32768
+#define LOGIC_ANALYZER_CHUNK_SIZE       168 // raw bytes per data message (192 bytes when encoded)
+#else
+#define LOGIC_ANALYZER_BUFFER_SIZE      256
+#define LOGIC_ANALYZER_CHUNK_SIZE       35 // raw bytes per data message (40 bytes when encoded)
+#endif
+#define LOGIC_ANALYZER_MAX_PORTS        4
+#define LOGIC_ANALYZER_TRIGGER_POLL_US  1000 // how long a burst capture waits for the trigger per loop pass
+
+// On AVR, Timer1 can be used with the build flag -DLOGIC_ANALYZER_USE_TIMER1. It's not enabled by default, because
+// the Servo library and the PWM outputs of Timer1 can't be used at the same time.
+#if defined(LOGIC_ANALYZER_USE_TIMER1) && defined(ARDUINO_ARCH_AVR)
+#if defined(FREQUENCY_USE_TIMER1) || defined(PATTERN_PLAYBACK_USE_TIMER1)
+#error "Only one of LOGIC_ANALYZER_USE_TIMER1, PATTERN_PLAYBACK_USE_TIMER1 and FREQUENCY_USE_TIMER1 can be used"
+#endif
+#define LOGIC_ANALYZER_TIMER1           1
+#endif
+
+#if defined(ESP32) || defined(LOGIC_ANALYZER_TIMER1)
+#define LOGIC_ANALYZER_HW_TIMER         1
+#ifdef ESP32
+#define LOGIC_ANALYZER_MIN_PERIOD_US    10
+#else
+#define LOGIC_ANALYZER_MIN_PERIOD_US    50
+#endif
+#endif
+
+/*
+ * Samples one or more consecutive Firmata ports into a ring buffer and sends the result as run-length encoded data.
+ * On the ESP32 (and on AVR with LOGIC_ANALYZER_USE_TIMER1), the samples are taken from a timer interrupt, on other
+ * boards (or if the period is too long for the timer) from the main loop. The trigger is evaluated on the first
+ * port for every sample, and the requested number of samples before the trigger is kept.
+ *
+ * A sample period of 0 selects a burst capture: each loop pass polls the trigger for up to
+ * LOGIC_ANALYZER_TRIGGER_POLL_US, then the whole buffer is filled in a tight loop with interrupts disabled.
+ * There is no pre-trigger window in this mode. The rate is limited by readPort(): with the register based
+ * versions (ARDUINO_PINOUT_OPTIMIZE, ESP32_PINOUT_OPTIMIZE, RP2040_PINOUT_OPTIMIZE) it's roughly 1 MSample/s
+ * on a 16MHz AVR and several MSamples/s on the ESP32 and RP2040, with the digitalRead() fallback only some
+ * 10 kSamples/s. The DONE message contains the measured duration, so the host knows the actual rate.
+ */
+class LogicAnalyzerFirmata: public FirmataFeature
+{
+  public:
+    LogicAnalyzerFirmata();
+    void handleCapability(byte pin);
+    boolean handlePinMode(byte pin, int mode);
+    boolean handleSysex(byte command, byte argc, byte* argv);
+    void report(bool elapsed);
+    void reset();
+#ifdef LOGIC_ANALYZER_HW_TIMER
+    static void timerIsr(); // called from the timer interrupt
+#endif
+
+  private:
+    enum class CaptureState
+    {
+      Idle,
+      Armed,
+      Capturing,
+      Done,
+      Sending,
+    };
+
+    void startCapture(byte argc, byte* argv);
+    void stopCapture();
+    bool isTriggered(byte value);
+    void takeSample();
+    void captureBurst();
+    void finishCapture();
+    void sendChunk();
+    byte* frameAt(uint32_t position);
+#ifdef LOGIC_ANALYZER_HW_TIMER
+    bool startTimer();
+    void stopTimer();
+#endif
+
+    volatile CaptureState state;
+    byte* buffer;
+    byte firstPort;
+    byte portCount;
+    bool timerActive;
+    uint32_t samplePeriod; // in us, 0 = burst capture
+    uint32_t sampleCount; // size of the ring buffer, in frames
+    uint32_t preTrigger; // frames to keep from before the trigger
+    uint32_t writeIndex;
+    uint32_t samplesTaken; // since the capture was armed
+    uint32_t triggerSample;
+    uint32_t nextSampleTime;
+    uint32_t captureStart;
+    uint32_t captureEnd;
+    uint32_t captureDuration;
+    byte triggerMode;
+    byte triggerMask;
+    byte triggerValue;
+    byte lastTriggerPort;
+    uint32_t sendStart;
+    uint32_t sendPosition;
+    uint32_t sendCount;
+    uint16_t chunkIndex;
+    Encoder7BitClass encoder;
+#ifdef ESP32
+    hw_timer_t* timer;
+#endif
+};
+
+#endif
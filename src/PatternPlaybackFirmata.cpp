@@ -0,0 +1,381 @@
+/*
+  PatternPlaybackFirmata.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <ConfigurableFirmata.h>
+#include "PatternPlaybackFirmata.h"
+
+#ifndef ARDUINO_ISR_ATTR
+#define ARDUINO_ISR_ATTR
+#endif
+
+// The pattern state is shared with the timer interrupt. On the ESP32, disabling the interrupts of the
+// current core doesn't keep the timer interrupt (possibly on the other core) out, so a spinlock is required.
+#ifdef ESP32
+static portMUX_TYPE playbackMux = portMUX_INITIALIZER_UNLOCKED;
+#define ENTER_CRITICAL() portENTER_CRITICAL(&playbackMux)
+#define EXIT_CRITICAL() portEXIT_CRITICAL(&playbackMux)
+#else
+#define ENTER_CRITICAL() noInterrupts()
+#define EXIT_CRITICAL() interrupts()
+#endif
+
+PatternPlaybackFirmata *PatternPlaybackFirmataInstance;
+
+PatternPlaybackFirmata::PatternPlaybackFirmata()
+{
+  PatternPlaybackFirmataInstance = this;
+  for (byte i = 0; i < 2; i++) {
+    segments[i].count = 0;
+    segments[i].loops = 0;
+    segments[i].ready = false;
+  }
+  activeSegment = 0;
+  state = PATTERN_PLAYBACK_STATE_IDLE;
+  statusChanged = false;
+  position = 0;
+  passes = 0;
+  nextEventTime = 0;
+  triggerPin = PATTERN_PLAYBACK_NO_TRIGGER;
+  triggerLevel = HIGH;
+#ifdef ESP32
+  timer = nullptr;
+#endif
+#ifdef PATTERN_PLAYBACK_TIMER1
+  timer1Active = false;
+#endif
+}
+
+void PatternPlaybackFirmata::handleCapability(byte pin)
+{
+}
+
+boolean PatternPlaybackFirmata::handlePinMode(byte pin, int mode)
+{
+  // Uses pins in OUTPUT mode, does not have its own mode
+  return false;
+}
+
+boolean PatternPlaybackFirmata::handleSysex(byte command, byte argc, byte* argv)
+{
+  if (command != PATTERN_PLAYBACK || argc < 1) {
+    return false;
+  }
+  switch (argv[0]) {
+    case PATTERN_PLAYBACK_CLEAR:
+    {
+      // Otherwise the timer interrupt might just be switching to a committed pending segment
+      ENTER_CRITICAL();
+      pattern_segment& pending = segments[1 - activeSegment];
+      pending.ready = false;
+      pending.count = 0;
+      EXIT_CRITICAL();
+      return true;
+    }
+    case PATTERN_PLAYBACK_APPEND:
+      appendEntries(argc - 1, argv + 1);
+      return true;
+    case PATTERN_PLAYBACK_COMMIT:
+    {
+      // Expected: subcommand, number of passes (2 bytes)
+      pattern_segment& pending = segments[1 - activeSegment];
+      if (argc < 3 || pending.count == 0) {
+        Firmata.sendString(F("Cannot commit an empty pattern"));
+        return true;
+      }
+      ENTER_CRITICAL();
+      pending.loops = Firmata.decodePackedUInt14(argv + 1);
+      pending.ready = true;
+      EXIT_CRITICAL();
+      return true;
+    }
+    case PATTERN_PLAYBACK_START:
+      // Expected: subcommand [, trigger pin, trigger level]
+      start(argc >= 3 ? argv[1] : PATTERN_PLAYBACK_NO_TRIGGER, argc >= 3 ? argv[2] : HIGH);
+      return true;
+    case PATTERN_PLAYBACK_STOP:
+      stop();
+      sendStatus();
+      return true;
+  }
+  return false;
+}
+
+/*
+ * Each entry consists of: delay to the previous entry in us (packed uint32), port, value (2 bytes), mask (2 bytes).
+ * Only pins that are currently in OUTPUT mode can be used.
+ */
+void PatternPlaybackFirmata::appendEntries(byte argc, byte* argv)
+{
+  pattern_segment& pending = segments[1 - activeSegment];
+  if (pending.ready) {
+    Firmata.sendString(F("The pending pattern is already committed"));
+    return;
+  }
+  if (argc % 10 != 0) {
+    Firmata.sendString(F("Invalid length of pattern entries"), argc);
+    return;
+  }
+  for (byte i = 0; i < argc; i += 10) {
+    if (pending.count >= PATTERN_PLAYBACK_MAX_ENTRIES) {
+      Firmata.sendString(F("Pattern too long"));
+      return;
+    }
+    pattern_entry& entry = pending.entries[pending.count];
+    entry.delay = Firmata.decodePackedUInt32(argv + i);
+    entry.port = argv[i + 5];
+    entry.value = argv[i + 6] | (argv[i + 7] << 7);
+    entry.mask = argv[i + 8] | (argv[i + 9] << 7);
+    if (entry.port >= TOTAL_PORTS) {
+      Firmata.sendString(F("Invalid port number"), entry.port);
+      return;
+    }
+    for (byte bit = 0; bit < 8; bit++) {
+      byte pin = entry.port * 8 + bit;
+      if ((entry.mask & (1 << bit)) && (pin >= TOTAL_PINS || Firmata.getPinMode(pin) != PIN_MODE_OUTPUT)) {
+        Firmata.sendString(F("Pattern uses a pin that is not an output"), pin);
+        return;
+      }
+    }
+    pending.count++;
+  }
+}
+
+void PatternPlaybackFirmata::start(byte pin, byte level)
+{
+  stop();
+  if (!segments[activeSegment].ready) {
+    if (!segments[1 - activeSegment].ready) {
+      Firmata.sendString(F("No pattern committed"));
+      return;
+    }
+    activeSegment = 1 - activeSegment;
+  }
+  if (pin != PATTERN_PLAYBACK_NO_TRIGGER && (pin >= TOTAL_PINS || !IS_PIN_DIGITAL(pin))) {
+    Firmata.sendString(F("Invalid trigger pin"), pin);
+    return;
+  }
+  triggerPin = pin;
+  triggerLevel = level ? HIGH : LOW;
+  if (triggerPin == PATTERN_PLAYBACK_NO_TRIGGER) {
+    begin();
+  } else {
+    state = PATTERN_PLAYBACK_STATE_ARMED;
+  }
+  sendStatus();
+}
+
+void PatternPlaybackFirmata::begin()
+{
+  segments[activeSegment].ready = false; // consumed, the other segment can now be uploaded
+  position = 0;
+  passes = 0;
+#ifdef ESP32
+  if (timer == nullptr) {
+    timer = timerBegin(1000000); // 1us resolution
+    timerAttachInterrupt(timer, timerIsr);
+  }
+  timerStop(timer);
+  timerWrite(timer, 0);
+  nextEventTime = segments[activeSegment].entries[0].delay;
+  state = PATTERN_PLAYBACK_STATE_PLAYING;
+  timerAlarm(timer, nextEventTime, false, 0);
+  timerStart(timer);
+#elif defined(PATTERN_PLAYBACK_TIMER1)
+  noInterrupts();
+  nextEventTime = micros() + segments[activeSegment].entries[0].delay;
+  state = PATTERN_PLAYBACK_STATE_PLAYING;
+  // Normal mode, prescaler 8, only compare match A is used
+  TCCR1A = 0;
+  TCCR1B = _BV(CS11);
+  TIFR1 = _BV(OCF1A);
+  scheduleTimer1();
+  TIMSK1 = _BV(OCIE1A);
+  timer1Active = true;
+  interrupts();
+#else
+  nextEventTime = micros() + segments[activeSegment].entries[0].delay;
+  state = PATTERN_PLAYBACK_STATE_PLAYING;
+#endif
+}
+
+void PatternPlaybackFirmata::stop()
+{
+  ENTER_CRITICAL();
+  state = PATTERN_PLAYBACK_STATE_IDLE;
+  EXIT_CRITICAL();
+#ifdef ESP32
+  if (timer != nullptr) {
+    timerStop(timer);
+  }
+#endif
+#ifdef PATTERN_PLAYBACK_TIMER1
+  stopTimer1();
+#endif
+}
+
+void PatternPlaybackFirmata::sendStatus()
+{
+  ENTER_CRITICAL();
+  statusChanged = false;
+  byte currentState = state;
+  byte segment = activeSegment;
+  bool pendingReady = segments[1 - segment].ready;
+  EXIT_CRITICAL();
+  Firmata.startSysex();
+  Firmata.write(PATTERN_PLAYBACK);
+  Firmata.write(PATTERN_PLAYBACK_STATUS);
+  Firmata.write(currentState);
+  Firmata.write(segment);
+  Firmata.write(pendingReady ? 1 : 0);
+  Firmata.endSysex();
+}
+
+/*
+ * Executes all entries that are due at the given time. Called from the timer interrupt on the ESP32,
+ * from the main loop otherwise. Returns false when the playback has ended.
+ */
+bool ARDUINO_ISR_ATTR PatternPlaybackFirmata::executeDue(uint32_t now)
+{
+  while (state == PATTERN_PLAYBACK_STATE_PLAYING && (int32_t)(now - nextEventTime) >= 0) {
+    pattern_segment* segment = &segments[activeSegment];
+    const pattern_entry& entry = segment->entries[position];
+    writePort(entry.port, entry.value, entry.mask);
+    if (++position >= segment->count) {
+      position = 0;
+      passes++;
+      if (segment->loops == 0 || passes >= segment->loops) {
+        byte next = 1 - activeSegment;
+        if (segments[next].ready) {
+          segments[next].ready = false;
+          activeSegment = next;
+          segment = &segments[next];
+          passes = 0;
+          statusChanged = true;
+        } else if (segment->loops != 0) {
+          state = PATTERN_PLAYBACK_STATE_IDLE;
+          statusChanged = true;
+          return false;
+        }
+      }
+    }
+    nextEventTime += segment->entries[position].delay;
+  }
+  return state == PATTERN_PLAYBACK_STATE_PLAYING;
+}
+
+#ifdef ESP32
+void ARDUINO_ISR_ATTR PatternPlaybackFirmata::timerIsr()
+{
+  PatternPlaybackFirmata* self = PatternPlaybackFirmataInstance;
+  uint64_t now = timerRead(self->timer);
+  while (true) {
+    portENTER_CRITICAL_ISR(&playbackMux);
+    bool playing = self->executeDue((uint32_t)now);
+    portEXIT_CRITICAL_ISR(&playbackMux);
+    if (!playing) {
+      break;
+    }
+    // The alarm is absolute, so convert the (wrapping) 32 bit event time back to the 64 bit counter
+    timerAlarm(self->timer, now + (int32_t)(self->nextEventTime - (uint32_t)now), false, 0);
+    now = timerRead(self->timer);
+    // If the next entry became due while setting up the alarm, the alarm won't fire anymore
+    if ((int32_t)((uint32_t)now - self->nextEventTime) < 0) {
+      break;
+    }
+  }
+}
+#endif
+
+#ifdef PATTERN_PLAYBACK_TIMER1
+ISR(TIMER1_COMPA_vect)
+{
+  PatternPlaybackFirmata::timerIsr();
+}
+
+void PatternPlaybackFirmata::timerIsr()
+{
+  PatternPlaybackFirmata* self = PatternPlaybackFirmataInstance;
+  if (self->executeDue(micros())) {
+    self->scheduleTimer1();
+  } else {
+    TIMSK1 = 0;
+  }
+}
+
+/*
+ * Sets the compare match to the next entry. Long delays are split in several waits, because the counter only has 16 bits.
+ * Must be called with interrupts disabled.
+ */
+void PatternPlaybackFirmata::scheduleTimer1()
+{
+  int32_t wait = (int32_t)(nextEventTime - micros());
+  if (wait < 4) {
+    // already due: fire as soon as possible
+    wait = 4;
+  } else if (wait > PATTERN_PLAYBACK_TIMER1_MAX_WAIT) {
+    wait = PATTERN_PLAYBACK_TIMER1_MAX_WAIT;
+  }
+  OCR1A = TCNT1 + (uint16_t)(wait * PATTERN_PLAYBACK_TIMER1_TICKS_PER_US);
+}
+
+/*
+ * Restores the configuration of the Arduino core (8 bit phase correct PWM, prescaler 64), but only if
+ * the timer was used, so that the Servo library isn't disturbed.
+ */
+void PatternPlaybackFirmata::stopTimer1()
+{
+  if (!timer1Active) {
+    return;
+  }
+  noInterrupts();
+  TIMSK1 = 0;
+  TCCR1B = _BV(CS11) | _BV(CS10);
+  TCCR1A = _BV(WGM10);
+  timer1Active = false;
+  interrupts();
+}
+#endif
+
+void PatternPlaybackFirmata::report(bool elapsed)
+{
+  if (state == PATTERN_PLAYBACK_STATE_ARMED && digitalRead(PIN_TO_DIGITAL(triggerPin)) == triggerLevel) {
+    begin();
+    statusChanged = true;
+  }
+#if !defined(ESP32) && !defined(PATTERN_PLAYBACK_TIMER1)
+  if (state == PATTERN_PLAYBACK_STATE_PLAYING) {
+    executeDue(micros());
+  }
+#endif
+  if (statusChanged) {
+#ifdef ESP32
+    if (state == PATTERN_PLAYBACK_STATE_IDLE) {
+      timerStop(timer);
+    }
+#endif
+#ifdef PATTERN_PLAYBACK_TIMER1
+    if (state == PATTERN_PLAYBACK_STATE_IDLE) {
+      stopTimer1();
+    }
+#endif
+    sendStatus();
+  }
+}
+
+void PatternPlaybackFirmata::reset()
+{
+  stop();
+  for (byte i = 0; i < 2; i++) {
+    segments[i].count = 0;
+    segments[i].ready = false;
+  }
+  statusChanged = false;
+}
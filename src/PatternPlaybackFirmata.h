@@ -0,0 +1,107 @@
+/*
+  PatternPlaybackFirmata.h - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef PatternPlaybackFirmata_h
+#define PatternPlaybackFirmata_h
+
+#include <ConfigurableFirmata.h>
+#include "FirmataFeature.h"
+
+#define PATTERN_PLAYBACK_CLEAR          0x00 // clear the pending segment
+#define PATTERN_PLAYBACK_APPEND         0x01 // append entries to the pending segment
+#define PATTERN_PLAYBACK_COMMIT         0x02 // the pending segment is complete and is played after the active one
+#define PATTERN_PLAYBACK_START          0x03 // start playing, optionally waiting for a trigger pin
+#define PATTERN_PLAYBACK_STOP           0x04 // stop playing
+#define PATTERN_PLAYBACK_STATUS         0x05 // reply: playback state changed
+
+#define PATTERN_PLAYBACK_STATE_IDLE     0x00
+#define PATTERN_PLAYBACK_STATE_ARMED    0x01
+#define PATTERN_PLAYBACK_STATE_PLAYING  0x02
+
+#define PATTERN_PLAYBACK_NO_TRIGGER     0x7F
+
+// On AVR, Timer1 can be used with the build flag -DPATTERN_PLAYBACK_USE_TIMER1. It's not enabled by default, because
+// the Servo library and the PWM outputs of Timer1 can't be used at the same time.
+#if defined(PATTERN_PLAYBACK_USE_TIMER1) && defined(ARDUINO_ARCH_AVR)
+#ifdef FREQUENCY_USE_TIMER1
+#error "PATTERN_PLAYBACK_USE_TIMER1 and FREQUENCY_USE_TIMER1 can't be used together"
+#endif
+#define PATTERN_PLAYBACK_TIMER1         1
+#define PATTERN_PLAYBACK_TIMER1_TICKS_PER_US (F_CPU / 8000000UL) // prescaler 8
+#define PATTERN_PLAYBACK_TIMER1_MAX_WAIT 30000 // us, the 16 bit counter wraps after 32.7ms at 16MHz
+#endif
+
+#ifdef LARGE_MEM_DEVICE
+#define PATTERN_PLAYBACK_MAX_ENTRIES    256 // per segment
+#else
+#define PATTERN_PLAYBACK_MAX_ENTRIES    16 // per segment
+#endif
+
+struct pattern_entry {
+  uint32_t delay; // in us, relative to the previous entry
+  byte port;
+  byte value;
+  byte mask;
+};
+
+struct pattern_segment {
+  pattern_entry entries[PATTERN_PLAYBACK_MAX_ENTRIES];
+  uint16_t count;
+  uint16_t loops; // number of passes, 0 = repeat until the next segment is ready
+  volatile bool ready;
+};
+
+/*
+ * Plays back a table of timed port writes. There are two segments: one is played while the
+ * other one can be uploaded. On the ESP32 (and on AVR with PATTERN_PLAYBACK_USE_TIMER1), the entries
+ * are executed from a hardware timer interrupt, on other boards from the main loop.
+ */
+class PatternPlaybackFirmata: public FirmataFeature
+{
+  public:
+    PatternPlaybackFirmata();
+    void handleCapability(byte pin);
+    boolean handlePinMode(byte pin, int mode);
+    boolean handleSysex(byte command, byte argc, byte* argv);
+    void report(bool elapsed);
+    void reset();
+#if defined(ESP32) || defined(PATTERN_PLAYBACK_TIMER1)
+    static void timerIsr(); // called from the timer interrupt
+#endif
+
+  private:
+    void appendEntries(byte argc, byte* argv);
+    void start(byte triggerPin, byte triggerLevel);
+    void begin();
+    void stop();
+    void sendStatus();
+    bool executeDue(uint32_t now);
+#ifdef ESP32
+    hw_timer_t* timer;
+#endif
+#ifdef PATTERN_PLAYBACK_TIMER1
+    void scheduleTimer1();
+    void stopTimer1();
+    bool timer1Active;
+#endif
+
+    pattern_segment segments[2];
+    volatile byte activeSegment; // the other one is the pending segment
+    volatile byte state;
+    volatile bool statusChanged;
+    uint16_t position;
+    uint16_t passes;
+    uint32_t nextEventTime;
+    byte triggerPin;
+    byte triggerLevel;
+};
+
+#endif
@@ -0,0 +1,264 @@
+/*
+  SonarFirmata.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <ConfigurableFirmata.h>
+#include "SonarFirmata.h"
+
+#ifndef ARDUINO_ISR_ATTR
+#define ARDUINO_ISR_ATTR
+#endif
+
+byte SonarFirmata::echoPin = 0;
+volatile bool SonarFirmata::echoStarted = false;
+volatile uint32_t SonarFirmata::echoRise = 0;
+volatile uint32_t SonarFirmata::echoFall = 0;
+volatile bool SonarFirmata::echoDone = false;
+
+SonarFirmata::SonarFirmata()
+{
+  numSensors = 0;
+  activeSensor = -1;
+  nextSensor = 0;
+  pingStart = 0;
+}
+
+void SonarFirmata::handleCapability(byte pin)
+{
+  if (IS_PIN_DIGITAL(pin)) {
+    Firmata.write(PIN_MODE_SONAR);
+    Firmata.write(14); // distance in mm
+  }
+}
+
+boolean SonarFirmata::handlePinMode(byte pin, int mode)
+{
+  if (!IS_PIN_DIGITAL(pin)) {
+    return false;
+  }
+  if (mode == PIN_MODE_SONAR) {
+    return true;
+  }
+  for (int i = numSensors - 1; i >= 0; i--) {
+    if (sensors[i].triggerPin == pin || sensors[i].echoPin == pin) {
+      removeSensor(i);
+    }
+  }
+  return false;
+}
+
+boolean SonarFirmata::handleSysex(byte command, byte argc, byte* argv)
+{
+  if (command != SONAR_DATA || argc < 2) {
+    return false;
+  }
+  if (argv[0] == SONAR_CONFIG) {
+    configureSensor(argc - 1, argv + 1);
+    return true;
+  }
+  if (argv[0] == SONAR_REMOVE) {
+    for (int i = numSensors - 1; i >= 0; i--) {
+      if (argv[1] == SONAR_ALL_SENSORS || sensors[i].triggerPin == argv[1]) {
+        removeSensor(i);
+      }
+    }
+    return true;
+  }
+  return false;
+}
+
+/*
+ * Format: trigger pin, echo pin, ping interval in ms (14 bit), maximum distance in cm (14 bit, 0 for the default)
+ */
+void SonarFirmata::configureSensor(byte argc, byte* argv)
+{
+  if (argc < 6) {
+    Firmata.sendString(F("Error in sonar command: Not enough parameters"));
+    return;
+  }
+  byte triggerPin = argv[0];
+  byte echo = argv[1];
+  if (triggerPin >= TOTAL_PINS || echo >= TOTAL_PINS || !IS_PIN_DIGITAL(triggerPin) || !IS_PIN_DIGITAL(echo)) {
+    Firmata.sendString(F("Invalid sonar pin"));
+    return;
+  }
+  if (digitalPinToInterrupt(echo) < 0) {
+    Firmata.sendString(F("Sonar echo pin must support interrupts"), echo);
+    return;
+  }
+  uint16_t maxDistance = Firmata.decodePackedUInt14(argv + 4);
+  if (maxDistance == 0) {
+    maxDistance = SONAR_DEFAULT_MAX_DISTANCE;
+  }
+  uint32_t timeout = (uint32_t)maxDistance * SONAR_US_PER_CM + SONAR_ECHO_DELAY;
+
+  // Replaces the sensor with this trigger pin and any other sensor using one of the pins
+  for (int i = numSensors - 1; i >= 0; i--) {
+    if (sensors[i].triggerPin == triggerPin || sensors[i].echoPin == echo ||
+        sensors[i].triggerPin == echo || sensors[i].echoPin == triggerPin) {
+      removeSensor(i);
+    }
+  }
+  if (numSensors >= SONAR_MAX_SENSORS) {
+    Firmata.sendString(F("Too many sonar sensors"));
+    return;
+  }
+
+  Firmata.setPinMode(triggerPin, PIN_MODE_SONAR);
+  Firmata.setPinMode(echo, PIN_MODE_SONAR);
+  pinMode(echo, INPUT);
+  if (echo != triggerPin) {
+    pinMode(triggerPin, OUTPUT);
+    digitalWrite(triggerPin, LOW);
+  }
+
+  sonar_sensor& sensor = sensors[numSensors++];
+  sensor.triggerPin = triggerPin;
+  sensor.echoPin = echo;
+  sensor.pingInterval = Firmata.decodePackedUInt14(argv + 2);
+  sensor.timeout = timeout > 0xFFFF ? 0xFFFF : (uint16_t)timeout;
+  sensor.lastPing = millis() - sensor.pingInterval;
+  sensor.distance = SONAR_NO_ECHO;
+  sensor.newResult = false;
+}
+
+void SonarFirmata::removeSensor(byte index)
+{
+  if (activeSensor >= 0) {
+    // Simpler than keeping track of the moving index, the ping is just repeated
+    detachInterrupt(digitalPinToInterrupt(sensors[activeSensor].echoPin));
+    activeSensor = -1;
+  }
+  for (byte i = index; i + 1 < numSensors; i++) {
+    sensors[i] = sensors[i + 1];
+  }
+  numSensors--;
+}
+
+void ARDUINO_ISR_ATTR SonarFirmata::echoIsr()
+{
+  // Only the first pulse counts, later edges (e.g. from a second echo) would corrupt the measured time
+  if (echoDone) {
+    return;
+  }
+  uint32_t now = micros();
+  if (digitalRead(echoPin) == HIGH) {
+    if (!echoStarted) {
+      echoRise = now;
+      echoStarted = true;
+    }
+  } else if (echoStarted) {
+    echoFall = now;
+    echoDone = true;
+  }
+}
+
+void SonarFirmata::startPing(byte index)
+{
+  sonar_sensor& sensor = sensors[index];
+  bool singlePin = sensor.triggerPin == sensor.echoPin;
+  if (singlePin) {
+    pinMode(sensor.triggerPin, OUTPUT);
+  }
+  // A 10us pulse starts the measurement. This is the only (short) busy wait.
+  digitalWrite(sensor.triggerPin, LOW);
+  delayMicroseconds(2);
+  digitalWrite(sensor.triggerPin, HIGH);
+  delayMicroseconds(10);
+  digitalWrite(sensor.triggerPin, LOW);
+  if (singlePin) {
+    pinMode(sensor.triggerPin, INPUT);
+  }
+
+  echoPin = sensor.echoPin;
+  echoStarted = false;
+  echoDone = false;
+  attachInterrupt(digitalPinToInterrupt(echoPin), echoIsr, CHANGE);
+  pingStart = micros();
+  sensor.lastPing = millis();
+  activeSensor = index;
+}
+
+void SonarFirmata::finishPing(uint32_t echoTime)
+{
+  sonar_sensor& sensor = sensors[activeSensor];
+  detachInterrupt(digitalPinToInterrupt(sensor.echoPin));
+  if (echoTime == 0) {
+    sensor.distance = SONAR_NO_ECHO;
+  } else {
+    uint32_t distance = echoTime * 10 / SONAR_US_PER_CM;
+    sensor.distance = distance > 0x3FFF ? 0x3FFF : (uint16_t)distance;
+  }
+  sensor.newResult = true;
+  activeSensor = -1;
+}
+
+/*
+ * Format: a list of trigger pin, distance in mm (14 bit). Only sensors that were pinged since the last report are included.
+ */
+void SonarFirmata::sendDistances()
+{
+  Firmata.sendTimestamp();
+  Firmata.startSysex();
+  Firmata.write(SONAR_DATA);
+  Firmata.write(SONAR_DISTANCES);
+  for (byte i = 0; i < numSensors; i++) {
+    if (sensors[i].newResult) {
+      Firmata.write(sensors[i].triggerPin);
+      Firmata.sendPackedUInt14(sensors[i].distance);
+      sensors[i].newResult = false;
+    }
+  }
+  Firmata.endSysex();
+}
+
+void SonarFirmata::report(bool elapsed)
+{
+  if (activeSensor >= 0) {
+    if (echoDone) {
+      finishPing(echoFall - echoRise);
+    } else if (micros() - pingStart > sensors[activeSensor].timeout) {
+      finishPing(0);
+    }
+  }
+
+  if (activeSensor < 0) {
+    uint32_t now = millis();
+    for (byte i = 0; i < numSensors; i++) {
+      byte index = (nextSensor + i) % numSensors;
+      sonar_sensor& sensor = sensors[index];
+      // After a missed echo, the HC-SR04 keeps its echo line high for a while and can't be triggered
+      if (now - sensor.lastPing >= sensor.pingInterval && digitalRead(sensor.echoPin) == LOW) {
+        startPing(index);
+        nextSensor = index + 1;
+        break;
+      }
+    }
+  }
+
+  if (elapsed) {
+    for (byte i = 0; i < numSensors; i++) {
+      if (sensors[i].newResult) {
+        sendDistances();
+        break;
+      }
+    }
+  }
+}
+
+void SonarFirmata::reset()
+{
+  if (activeSensor >= 0) {
+    detachInterrupt(digitalPinToInterrupt(sensors[activeSensor].echoPin));
+    activeSensor = -1;
+  }
+  numSensors = 0;
+  nextSensor = 0;
+}
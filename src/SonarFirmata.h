@@ -0,0 +1,80 @@
+/*
+  SonarFirmata.h - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef SonarFirmata_h
+#define SonarFirmata_h
+
+#include <ConfigurableFirmata.h>
+#include "FirmataFeature.h"
+
+#define SONAR_CONFIG                0x00 // add or change a sensor
+#define SONAR_REMOVE                0x01 // remove a sensor (or all, with pin 0x7F)
+#define SONAR_DISTANCES             0x02 // reply: the latest distances of all sensors that were pinged
+
+#define SONAR_ALL_SENSORS           0x7F
+#define SONAR_NO_ECHO               0    // distance reported if there was no echo within the range
+#define SONAR_DEFAULT_MAX_DISTANCE  400  // in cm
+#define SONAR_US_PER_CM             58   // round trip time of the sound per cm of distance
+#define SONAR_ECHO_DELAY            500  // the HC-SR04 raises the echo line about this many us after the trigger
+
+#ifdef LARGE_MEM_DEVICE
+#define SONAR_MAX_SENSORS           8
+#else
+#define SONAR_MAX_SENSORS           4
+#endif
+
+struct sonar_sensor {
+  byte triggerPin;
+  byte echoPin;          // same as triggerPin for sensors with a single signal pin
+  uint16_t pingInterval; // minimum time between two pings of this sensor, in ms
+  uint16_t timeout;      // maximum time to wait for the echo, in us
+  uint32_t lastPing;     // millis()
+  uint16_t distance;     // in mm
+  bool newResult;
+};
+
+/*
+ * Measures distances with HC-SR04 style ultrasonic sensors without blocking the loop. The sensors are
+ * pinged one after the other, so they don't hear each other's echo. The echo pulse is timed by an interrupt
+ * on the echo pin, therefore the echo pin must support attachInterrupt().
+ */
+class SonarFirmata: public FirmataFeature
+{
+  public:
+    SonarFirmata();
+    void handleCapability(byte pin);
+    boolean handlePinMode(byte pin, int mode);
+    boolean handleSysex(byte command, byte argc, byte* argv);
+    void report(bool elapsed);
+    void reset();
+
+  private:
+    void configureSensor(byte argc, byte* argv);
+    void removeSensor(byte index);
+    void startPing(byte index);
+    void finishPing(uint32_t echoTime);
+    void sendDistances();
+    static void echoIsr();
+
+    sonar_sensor sensors[SONAR_MAX_SENSORS];
+    byte numSensors;
+    int activeSensor;    // the sensor that is waiting for its echo, -1 if none
+    byte nextSensor;     // round robin position
+    uint32_t pingStart;  // micros() when the trigger pulse ended
+
+    static byte echoPin;
+    static volatile bool echoStarted;
+    static volatile uint32_t echoRise;
+    static volatile uint32_t echoFall;
+    static volatile bool echoDone;
+};
+
+#endif
@@ -731,6 +731,10 @@ writePort(port, value, bitmask):  Write an 8 bit port.
 #define DEFAULT_PWM_RESOLUTION  8
 #define DEFAULT_ADC_RESOLUTION  12
 #define LARGE_MEM_DEVICE        320
+// Firmata ports map directly to the GPIO registers (GPIO0-31 in GPIO_IN_REG, GPIO32+ in GPIO_IN1_REG)
+#include <soc/soc.h>
+#include <soc/gpio_reg.h>
+#define ESP32_PINOUT_OPTIMIZE   1
 
 // Adafruit Bluefruit nRF52 boards
 #elif defined(ARDUINO_NRF52_ADAFRUIT)
@@ -797,6 +801,14 @@ static inline void attachInterrupt(pin_size_t interruptNumber, voidFuncPtr callb
 #define PIN_TO_ANALOG(p)        ((p) - 26)
 #define PIN_TO_PWM(p)           (p)
 #define PIN_TO_SERVO(p)         (p)
+// Firmata ports map directly to the bits of the single-cycle IO block. Only where the Arduino pin numbers are
+// the GPIO numbers: the mbed core (including the Nano RP2040 Connect) uses its own pin numbering.
+#if defined(__has_include) && !defined(ARDUINO_ARCH_MBED) && !defined(ARDUINO_NANO_RP2040_CONNECT)
+#if __has_include(<hardware/structs/sio.h>)
+#include <hardware/structs/sio.h>
+#define RP2040_PINOUT_OPTIMIZE  1
+#endif
+#endif
 
 // Arduino UNO R4 Minima and Wifi
 // The pinout is the same as for the classical UNO R3
@@ -844,6 +856,47 @@ static inline void attachInterrupt(pin_size_t interruptNumber, voidFuncPtr callb
 
 #define MODE_INPUT 0 /* Because the name INPUT causes conflicts compiling on Windows */
 
+// The pins of a Firmata port are spread over the PORT groups, using the pin description table of the variant
+#if defined(ARDUINO_ARCH_SAMD) && !defined(ARDUINO_PINOUT_OPTIMIZE)
+#define SAMD_PINOUT_OPTIMIZE    1
+#ifndef PORT_GROUPS
+#define PORT_GROUPS             2
+#endif
+
+struct samd_port_map {
+  uint32_t groupMask[PORT_GROUPS]; // all digital pins of the Firmata port, per PORT group
+  uint32_t pinMask[8];             // 0 if the pin is not a digital pin
+  byte group[8];
+};
+
+/*
+ * Returns the PORT group bits of the pins of a Firmata port. The table is computed from the pin description
+ * table on first use. Not static, so that all translation units share one table.
+ */
+inline const samd_port_map& samdPortMap(byte port)
+{
+  static samd_port_map maps[(TOTAL_PINS + 7) / 8];
+  static bool initialized = false;
+  if (!initialized) {
+    for (byte pin = 0; pin < TOTAL_PINS; pin++) {
+      if (!IS_PIN_DIGITAL(pin)) {
+        continue;
+      }
+      const PinDescription& desc = g_APinDescription[PIN_TO_DIGITAL(pin)];
+      if ((int)desc.ulPort < 0 || (int)desc.ulPort >= PORT_GROUPS) {
+        continue;
+      }
+      samd_port_map& map = maps[pin / 8];
+      map.group[pin % 8] = (byte)desc.ulPort;
+      map.pinMask[pin % 8] = 1ul << desc.ulPin;
+      map.groupMask[desc.ulPort] |= 1ul << desc.ulPin;
+    }
+    initialized = true;
+  }
+  return maps[port];
+}
+#endif
+
 /*==============================================================================
  * readPort() - Read an 8 bit port
  *============================================================================*/
@@ -856,6 +909,30 @@ static inline unsigned char readPort(byte port, byte bitmask)
   if (port == 1) return ((PINB & 0x3F) | ((PINC & 0x03) << 6)) & bitmask;
   if (port == 2) return ((PINC & 0x3C) >> 2) & bitmask;
   return 0;
+#elif defined(ESP32_PINOUT_OPTIMIZE)
+  if (port < 4) return (unsigned char)(REG_READ(GPIO_IN_REG) >> (port * 8)) & bitmask;
+#ifdef GPIO_IN1_REG
+  return (unsigned char)(REG_READ(GPIO_IN1_REG) >> ((port - 4) * 8)) & bitmask;
+#else
+  return 0;
+#endif
+#elif defined(RP2040_PINOUT_OPTIMIZE)
+  return (unsigned char)(sio_hw->gpio_in >> (port * 8)) & bitmask;
+#elif defined(SAMD_PINOUT_OPTIMIZE)
+  if (port >= (TOTAL_PINS + 7) / 8) return 0;
+  const samd_port_map& map = samdPortMap(port);
+  // Sample all groups once, so that all pins are read at the same time
+  uint32_t in[PORT_GROUPS];
+  for (byte g = 0; g < PORT_GROUPS; g++) {
+    in[g] = PORT->Group[g].IN.reg & map.groupMask[g];
+  }
+  unsigned char out = 0;
+  for (byte i = 0; i < 8; i++) {
+    if (in[map.group[i]] & map.pinMask[i]) {
+      out |= 1 << i;
+    }
+  }
+  return out & bitmask;
 #else
   unsigned char out = 0, pin = port * 8;
   if (IS_PIN_DIGITAL(pin + 0) && (bitmask & 0x01) && digitalRead(PIN_TO_DIGITAL(pin + 0))) out |= 0x01;
@@ -882,25 +959,67 @@ static inline unsigned char writePort(byte port, byte value, byte bitmask)
     bitmask = bitmask & 0xFC;  // do not touch Tx & Rx pins
     byte valD = value & bitmask;
     byte maskD = ~bitmask;
+    byte oldSREG = SREG; // restore instead of enabling, so this can be used while interrupts are disabled
     cli();
     PORTD = (PORTD & maskD) | valD;
-    sei();
+    SREG = oldSREG;
   } else if (port == 1) {
     byte valB = (value & bitmask) & 0x3F;
     byte valC = (value & bitmask) >> 6;
     byte maskB = ~(bitmask & 0x3F);
     byte maskC = ~((bitmask & 0xC0) >> 6);
+    byte oldSREG = SREG;
     cli();
     PORTB = (PORTB & maskB) | valB;
     PORTC = (PORTC & maskC) | valC;
-    sei();
+    SREG = oldSREG;
   } else if (port == 2) {
     bitmask = bitmask & 0x0F;
     byte valC = (value & bitmask) << 2;
     byte maskC = ~(bitmask << 2);
+    byte oldSREG = SREG;
     cli();
     PORTC = (PORTC & maskC) | valC;
-    sei();
+    SREG = oldSREG;
+  }
+  return 1;
+#elif defined(ESP32_PINOUT_OPTIMIZE)
+  // The set and clear registers only touch the pins with a 1 bit, so no read-modify-write is required
+  uint32_t set = (uint32_t)(value & bitmask);
+  uint32_t clear = (uint32_t)(~value & bitmask);
+  if (port < 4) {
+    REG_WRITE(GPIO_OUT_W1TS_REG, set << (port * 8));
+    REG_WRITE(GPIO_OUT_W1TC_REG, clear << (port * 8));
+  }
+#ifdef GPIO_OUT1_W1TS_REG
+  else {
+    REG_WRITE(GPIO_OUT1_W1TS_REG, set << ((port - 4) * 8));
+    REG_WRITE(GPIO_OUT1_W1TC_REG, clear << ((port - 4) * 8));
+  }
+#endif
+  return 1;
+#elif defined(RP2040_PINOUT_OPTIMIZE)
+  sio_hw->gpio_set = (uint32_t)(value & bitmask) << (port * 8);
+  sio_hw->gpio_clr = (uint32_t)(~value & bitmask) << (port * 8);
+  return 1;
+#elif defined(SAMD_PINOUT_OPTIMIZE)
+  if (port >= (TOTAL_PINS + 7) / 8) return 0;
+  const samd_port_map& map = samdPortMap(port);
+  uint32_t set[PORT_GROUPS] = {};
+  uint32_t clear[PORT_GROUPS] = {};
+  for (byte i = 0; i < 8; i++) {
+    if (bitmask & (1 << i)) {
+      // pinMask is 0 for pins that aren't digital pins
+      if (value & (1 << i)) {
+        set[map.group[i]] |= map.pinMask[i];
+      } else {
+        clear[map.group[i]] |= map.pinMask[i];
+      }
+    }
+  }
+  for (byte g = 0; g < PORT_GROUPS; g++) {
+    if (set[g]) PORT->Group[g].OUTSET.reg = set[g];
+    if (clear[g]) PORT->Group[g].OUTCLR.reg = clear[g];
   }
   return 1;
 #else